@@ -2,7 +2,6 @@
 #include "interrupts.h"
 #include "pic.h"
 #include "../sys/proc.h"
-#include "../sys/kmalloc.h"
 
 #define KB_TIMEOUT 3
 #define KB_DEFAULT_SCAN_CODE KB_SCAN_CODE_2
@@ -268,8 +267,7 @@ extern int KB_init(){
     toggles_set = 0;
 
     kbb.head = kbb.tail = kbb.buff;
-    blocked_procs = kmalloc(sizeof(blocked_procs));
-    PROC_init_queue(blocked_procs, BLOCK);
+    blocked_procs = PROC_create_queue(BLOCK);
 
     /* Reset keyboard. */
     res = KB_reset();
@@ -114,6 +114,18 @@ def main():
     # Dereference |next_proc| and store in rdi.
     f.write("\tmov rdi, [next_proc]\n")
 
+    #
+    # Switch address spaces. Kernel threads have no address space and run on
+    # whatever page tables are loaded, as do threads of the space already
+    # loaded, so CR3 is only written when it actually changes. Bit 63 is the
+    # PCID no flush bit, which always reads back as zero.
+    #
+    f.write("\tmov rsi, [rdi + 248]\n\tcmp rsi, 0\n\tje same_space\n")
+    f.write("\tmov rcx, [rsi]\n\tbtr rcx, 63\n")
+    f.write("\tmov rdx, cr3\n\tcmp rcx, rdx\n\tje same_space\n")
+    f.write("\tmov rcx, [rsi]\n\tmov cr3, rcx\n")
+    f.write("same_space:\n")
+
     # Load rax and rbx.
     f.write("\tmov rax, [rdi]\n\tmov rbx, [rdi + 8]\n")
 
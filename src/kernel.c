@@ -10,6 +10,7 @@
 #include "sys/memory.h"
 #include "sys/kmalloc.h"
 #include "sys/proc.h"
+#include "sys/cpu.h"
 #include "test/snakes.h"
 #include "init.h"
 #include "gdt.h"
@@ -71,11 +72,11 @@ void tss_init() {
     tss_sel.index = tss_index;
     __asm__("ltr %0": : "m"(tss_sel)); /* Load TSS selector. */
 
-    /* Set up critical ISTs. */
-    tss.ist1 = (uint64_t) MMU_pf_alloc();
-    tss.ist2 = (uint64_t) MMU_pf_alloc();
-    tss.ist3 = (uint64_t) MMU_pf_alloc();
-    tss.ist4 = (uint64_t) MMU_pf_alloc();
+    /* Set up critical ISTs. Stacks grow down from the end of each frame. */
+    tss.ist1 = (uint64_t) phys_to_virt((uint64_t) MMU_pf_alloc()) + PAGE_SIZE;
+    tss.ist2 = (uint64_t) phys_to_virt((uint64_t) MMU_pf_alloc()) + PAGE_SIZE;
+    tss.ist3 = (uint64_t) phys_to_virt((uint64_t) MMU_pf_alloc()) + PAGE_SIZE;
+    tss.ist4 = (uint64_t) phys_to_virt((uint64_t) MMU_pf_alloc()) + PAGE_SIZE;
 
     if (int_enabled)
         STI;
@@ -97,18 +98,27 @@ void read_keyboard() {
  * @post None.
  */
 int kernel_main(MB_basic_tag *mb_tag) {
+    uint64_t pf_init_cycles;
+
     /* 
      * Initializations.
      */
 
+    pf_init_cycles = rdtsc();
     MMU_pf_init(mb_tag); /* Initialize page allocator. */
+    pf_init_cycles = rdtsc() - pf_init_cycles;
 
     if (init() == EXIT_FAILURE)
         halt_cpu();
 
+    /* Printed late since the VGA driver is not up during MMU_pf_init(). */
+    printk("Page frame allocator initialized in %lu cycles\n", 
+     (unsigned long) pf_init_cycles);
+
     printk("\nD A N K O S\n\n>");
 
     PROC_create_kthread(read_keyboard, NULL);
+    PROC_create_kthread(MMU_zero_thread, NULL);
 
     while (1) {
         PROC_run();
@@ -3,9 +3,29 @@
 #include "lib/string.h"
 #include "lib/stdio.h"
 #include "sys/memory.h"
+#include "sys/cpu.h"
 #include "sys/kmalloc.h"
+#include "sys/slab.h"
+#include "sys/tlb.h"
+#include "sys/tlsf.h"
+#include "sys/kprof.h"
+#include "drivers/interrupts.h"
 
 #define KMALLOC_TEST_LEN 0xFFFFFF
+#define IRQ_TEST_INT 0x81
+#define IRQ_TEST_INT_ASM "int $0x81"
+#define IRQ_TEST_SLOTS 256
+#define IRQ_TEST_MAX_SIZE 2048
+#define IRQ_TEST_ROUNDS 100000
+#define TRIM_TEST_BLOCKS 64
+#if defined(KHEAP_TLSF)
+#define TRIM_TEST_SLACK TLSF_GROW_SIZE /* No TLSF_reserve() has run yet. */
+#elif defined(KHEAP_LIST)
+#define TRIM_TEST_SLACK LIST_TRIM_KEEP
+#endif
+#define LARGE_TEST_SIZE 0x1000000
+#define CPU_BENCH_ROUNDS 100000
+#define CPU_BENCH_BATCH 32
 
 /* Random functions provided by Dr. Nico. */
 static unsigned int seed = 1;
@@ -134,14 +154,148 @@ void page_fault_test() {
 }
 
 void page_frame_alloc_test() {
+    void *frame;
     int *page, i;
 
-    for (i = 1; (page = MMU_pf_alloc()); i++) {
+    for (i = 1; (frame = MMU_pf_alloc()); i++) {
+        page = phys_to_virt((uint64_t) frame);
         *page = i;
         printk("%u\n", *page);
     }
 }
 
+void buddy_alloc_test() {
+    uint64_t free_before = MMU_pf_free_count();
+    void *blocks[PF_MAX_ORDER + 1];
+    unsigned int order;
+
+    printk("\nTesting buddy allocator\n");
+    for (order = 0; order <= PF_MAX_ORDER; order++) {
+        blocks[order] = MMU_pf_alloc_order(order);
+        printk("order %u gave %p\n", order, blocks[order]);
+        if ((uint64_t) blocks[order] % ((uint64_t) PAGE_SIZE << order))
+            printk("Block of order %u is misaligned!\n", order);
+    }
+
+    for (order = 0; order <= PF_MAX_ORDER; order++)
+        if (blocks[order] && MMU_pf_free_order(blocks[order], order))
+            printk("Failed to free block of order %u\n", order);
+
+    if (MMU_pf_free_count() != free_before)
+        printk("Leaked %ld frames\n", 
+         (long) (free_before - MMU_pf_free_count()));
+    else
+        printk("All blocks coalesced back\n");
+}
+
+void pf_magazine_test() {
+    MEM_pf_mag_stats stats;
+    void *frames[256];
+    int i, round;
+
+    printk("\nTesting page frame magazines\n");
+    for (round = 0; round < 16; round++) {
+        for (i = 0; i < 256; i++)
+            frames[i] = MMU_pf_alloc();
+        for (i = 0; i < 256; i++)
+            MMU_pf_free(frames[i]);
+    }
+
+    MMU_pf_mag_stats(0, &stats);
+    printk("hits %lu misses %lu refills %lu drains %lu\n", 
+     (unsigned long) stats.hits, (unsigned long) stats.misses, 
+     (unsigned long) stats.refills, (unsigned long) stats.drains);
+}
+
+void page_desc_test() {
+    void *frame, *block;
+    MEM_page *page;
+    int ok = 1;
+
+    printk("\nTesting page frame descriptors (%u bytes each)\n", 
+     (unsigned int) sizeof(MEM_page));
+    frame = MMU_pf_alloc();
+    page = MMU_pf_to_page(frame);
+    if (!page || page->refcount != 1 || !(page->flags & PG_HEAD) || 
+     MMU_page_to_pf(page) != frame)
+        ok = 0;
+
+    MMU_pf_get(frame);
+    MMU_pf_put(frame);
+    if (page->refcount != 1) /* Still allocated. */
+        ok = 0;
+    MMU_pf_put(frame);
+    if (page->refcount || MMU_pf_free(frame) == EXIT_SUCCESS)
+        ok = 0; /* Freed by the last put, so this is a double free. */
+
+    block = MMU_pf_alloc_order(3);
+    if (MMU_pf_to_page(block)->order != 3 || 
+     MMU_pf_free_order(block, 2) == EXIT_SUCCESS)
+        ok = 0;
+    MMU_pf_free_order(block, 3);
+
+    printk("Descriptors %s\n", ok ? "tracked" : "NOT tracked");
+}
+
+void numa_test() {
+    MEM_node_stats before, after;
+    void *block;
+    int node, ok = 1;
+
+    printk("\nTesting NUMA zones (%d nodes)\n", MMU_num_nodes());
+    for (node = 0; node < MMU_num_nodes(); node++) {
+        MMU_node_stats(node, &before);
+        block = MMU_pf_alloc_node(node, 2);
+        MMU_node_stats(node, &after);
+
+        /* A node with free memory serves its own requests. */
+        if (before.free >= 4 && (MMU_pf_node(block) != node || 
+         after.local != before.local + 1 || after.used < before.used + 4))
+            ok = 0;
+        MMU_pf_free_order(block, 2);
+
+        printk("Node %d: present %lu used %lu local %lu remote %lu\n", node, 
+         (unsigned long) after.present, (unsigned long) after.used, 
+         (unsigned long) after.local, (unsigned long) after.remote);
+    }
+
+    if (MMU_pf_alloc_node(MMU_num_nodes(), 0)) /* No such node. */
+        ok = 0;
+
+    printk("Allocations %s\n", ok ? "local" : "NOT local");
+}
+
+void zero_pool_test() {
+    MEM_zero_stats stats;
+    uint64_t *frames[8], *buf;
+    int i, j, ok = 1;
+
+    printk("\nTesting zero pool\n");
+    MMU_zero_pool_fill(8);
+    for (i = 0; i < 8; i++) {
+        frames[i] = phys_to_virt((uint64_t) MMU_pf_alloc_zeroed());
+        for (j = 0; j < PAGE_SIZE / sizeof(uint64_t); j++)
+            if (frames[i][j])
+                ok = 0;
+        frames[i][0] = 1; /* Dirty it for whoever gets it next. */
+    }
+    for (i = 0; i < 8; i++)
+        MMU_pf_free((void *) virt_to_phys(frames[i]));
+
+    /* Most of a large kcalloc() lands on fresh pages. */
+    buf = kcalloc(16, PAGE_SIZE);
+    for (i = 0; i < 16 * PAGE_SIZE / sizeof(uint64_t); i++)
+        if (buf[i])
+            ok = 0;
+    kfree(buf);
+
+    MMU_zero_stats(&stats);
+    printk("Frames %s, hits %lu misses %lu zeroed %lu skipped %lu\n", 
+     ok ? "zeroed" : "NOT zeroed", (unsigned long) stats.hits, 
+     (unsigned long) stats.misses, (unsigned long) stats.zeroed, 
+     (unsigned long) stats.skipped);
+}
+
 void page_alloc_test() {
     char *test;
     int i;
@@ -157,6 +311,264 @@ void page_alloc_test() {
     }
 }
 
+static void touch_pages(char *pages, int num) {
+    int i;
+
+    for (i = 0; i < num; i++)
+        pages[i * PAGE_SIZE] = i;
+}
+
+void fault_around_test() {
+    MEM_fault_stats before, after;
+    char *pages;
+
+    printk("\nTesting fault around and populate\n");
+
+    MMU_set_fault_around(1);
+    MMU_fault_stats(&before);
+    pages = MMU_alloc_pages(16);
+    touch_pages(pages, 16);
+    MMU_fault_stats(&after);
+    printk("No fault around: %lu faults\n", 
+     (unsigned long) (after.faults - before.faults));
+    MMU_free_pages(pages, 16);
+
+    MMU_set_fault_around(16);
+    MMU_fault_stats(&before);
+    pages = MMU_alloc_pages(16);
+    touch_pages(pages, 16);
+    MMU_fault_stats(&after);
+    printk("Fault around 16: %lu faults\n", 
+     (unsigned long) (after.faults - before.faults));
+    MMU_free_pages(pages, 16);
+
+    MMU_fault_stats(&before);
+    pages = MMU_alloc_pages_flags(16, MMU_MAP_POPULATE);
+    touch_pages(pages, 16);
+    MMU_fault_stats(&after);
+    printk("Populated: %lu faults\n", 
+     (unsigned long) (after.faults - before.faults));
+    MMU_free_pages(pages, 16);
+}
+
+void vmem_test() {
+    VMEM_stats stats;
+    void *first, *second, *stack;
+    int i;
+
+    printk("\nTesting virtual range reuse\n");
+    first = MMU_alloc_pages(8);
+    MMU_free_pages(first, 8);
+    second = MMU_alloc_pages(8);
+    printk("%p %s reused\n", second, first == second ? "was" : "was NOT");
+    MMU_free_pages(second, 8);
+
+    for (i = 0; i < 1000; i++) {
+        stack = MMU_alloc_kstack();
+        MMU_free_kstack(stack);
+    }
+    MMU_region_stats(MMU_REGION_KSTACKS, &stats);
+    printk("kstacks: in use %lu free %lu allocs %lu frees %lu\n", 
+     (unsigned long) stats.in_use, (unsigned long) stats.free, 
+     (unsigned long) stats.allocs, (unsigned long) stats.frees);
+}
+
+void kstack_cache_test() {
+    MEM_kstack_stats stats;
+    void *stacks[16];
+    int i, round;
+
+    printk("\nTesting kernel stack cache\n");
+    for (round = 0; round < 100; round++) {
+        for (i = 0; i < 16; i++)
+            stacks[i] = MMU_alloc_kstack();
+        for (i = 0; i < 16; i++)
+            MMU_free_kstack(stacks[i]);
+    }
+
+    MMU_kstack_stats(&stats);
+    printk("hits %lu misses %lu high water %lu cached %lu\n", 
+     (unsigned long) stats.hits, (unsigned long) stats.misses, 
+     (unsigned long) stats.high_water, (unsigned long) stats.cached);
+}
+
+void addr_space_test() {
+    MMU_addr_space *first, *second;
+    uint64_t *user = (uint64_t *) USER_ADDR, *kern, free;
+    int i, ok = 1;
+
+    printk("\nTesting address spaces\n");
+    MMU_addr_space_put(MMU_create_addr_space()); /* Warm up the heap. */
+    free = MMU_pf_free_count();
+
+    kern = MMU_alloc_page();
+    *kern = 0xC0FFEE;
+    first = MMU_create_addr_space();
+    second = MMU_create_addr_space();
+
+    MMU_as_map_range(first, user, 4 * PAGE_SIZE, MMU_MAP_WRITE | MMU_MAP_USER);
+    MMU_switch_addr_space(first);
+    for (i = 0; i < 4; i++)
+        user[i * PAGE_SIZE / sizeof(uint64_t)] = i;
+    if (*kern != 0xC0FFEE) /* Kernel half is shared. */
+        ok = 0;
+    MMU_switch_addr_space(NULL);
+
+    /* The user mapping must not leak into other spaces. */
+    if (second->pml4[USER_ADDR >> 39].present)
+        ok = 0;
+
+    MMU_addr_space_put(first);
+    MMU_addr_space_put(second);
+    MMU_free_page(kern);
+
+    printk("Address spaces %s, frames %s\n", ok ? "isolated" : "NOT isolated",
+     free == MMU_pf_free_count() ? "returned" : "leaked");
+}
+
+void pcid_exhaust_test() {
+    static uint16_t pcids[NUM_PCIDS];
+    MMU_addr_space *first, *second;
+    uint64_t *user = (uint64_t *) USER_ADDR;
+    int i, num = 0, ok = 1;
+
+    printk("\nTesting address spaces without free PCIDs\n");
+    while ((pcids[num] = TLB_alloc_pcid()) != KERNEL_PCID)
+        num++;
+
+    /* Both fall back to KERNEL_PCID and must not see each other's entries. */
+    first = MMU_create_addr_space();
+    second = MMU_create_addr_space();
+    if (first->pcid != KERNEL_PCID || first->cr3 & CR3_NOFLUSH || 
+     second->cr3 & CR3_NOFLUSH)
+        ok = 0;
+
+    MMU_as_map_range(first, user, PAGE_SIZE, MMU_MAP_WRITE | MMU_MAP_USER);
+    MMU_as_map_range(second, user, PAGE_SIZE, MMU_MAP_WRITE | MMU_MAP_USER);
+    MMU_switch_addr_space(first);
+    *user = 1;
+    MMU_switch_addr_space(second);
+    *user = 2;
+    MMU_switch_addr_space(first);
+    if (*user != 1)
+        ok = 0;
+    MMU_switch_addr_space(second);
+    if (*user != 2)
+        ok = 0;
+    MMU_switch_addr_space(NULL);
+
+    MMU_addr_space_put(first);
+    MMU_addr_space_put(second);
+    for (i = 0; i < num; i++)
+        TLB_free_pcid(pcids[i]);
+
+    printk("Shared PCID spaces %s after %d PCIDs\n", 
+     ok ? "isolated" : "NOT isolated", num);
+}
+
+#define COW_PAGES 256
+#define COW_TOUCHED 16
+
+/** @brief Times cloning a space of COW_PAGES pages and writing COW_TOUCHED.
+ */
+static uint64_t time_clone(MMU_addr_space *parent, int cow) {
+    MMU_addr_space *child;
+    uint64_t *user = (uint64_t *) USER_ADDR, start;
+    int i;
+
+    start = rdtsc();
+    child = MMU_clone_addr_space(parent, cow);
+    MMU_switch_addr_space(child);
+    for (i = 0; i < COW_TOUCHED; i++)
+        user[i * PAGE_SIZE / sizeof(uint64_t)] = i + 1;
+    start = rdtsc() - start;
+
+    MMU_switch_addr_space(NULL);
+    MMU_addr_space_put(child);
+
+    return start;
+}
+
+void cow_clone_test() {
+    MMU_addr_space *parent, *child;
+    MEM_fault_stats stats;
+    uint64_t *user = (uint64_t *) USER_ADDR, *page, cow, eager;
+    int i, ok = 1;
+
+    printk("\nTesting copy-on-write clone\n");
+    parent = MMU_create_addr_space();
+    MMU_as_map_range(parent, user, COW_PAGES * PAGE_SIZE, 
+     MMU_MAP_WRITE | MMU_MAP_USER | MMU_MAP_POPULATE);
+    MMU_switch_addr_space(parent);
+    for (i = 0; i < COW_PAGES; i++)
+        user[i * PAGE_SIZE / sizeof(uint64_t)] = i;
+
+    /* Writes in the child must not show up in the parent and vice versa. */
+    child = MMU_clone_addr_space(parent, 1);
+    user[0] = 0xAAAA;
+    MMU_switch_addr_space(child);
+    if (user[0] != 0)
+        ok = 0;
+    user[PAGE_SIZE / sizeof(uint64_t)] = 0xBBBB;
+    MMU_switch_addr_space(parent);
+    if (user[PAGE_SIZE / sizeof(uint64_t)] != 1)
+        ok = 0;
+
+    /* Protecting a shared page read-only and back must not let writes reach
+     * the frame the child still maps.
+     */
+    page = user + 2 * PAGE_SIZE / sizeof(uint64_t);
+    MMU_protect_range(page, PAGE_SIZE, MMU_MAP_USER);
+    MMU_protect_range(page, PAGE_SIZE, MMU_MAP_WRITE | MMU_MAP_USER);
+    *page = 0xCCCC;
+    MMU_switch_addr_space(child);
+    if (*page != 2)
+        ok = 0;
+    MMU_switch_addr_space(parent);
+    MMU_addr_space_put(child);
+
+    cow = time_clone(parent, 1);
+    MMU_switch_addr_space(parent);
+    eager = time_clone(parent, 0);
+
+    MMU_switch_addr_space(NULL);
+    MMU_addr_space_put(parent);
+
+    MMU_fault_stats(&stats);
+    printk("COW clone %s, copies %lu reuses %lu\n", ok ? "isolated" : 
+     "NOT isolated", (unsigned long) stats.cow_copies, 
+     (unsigned long) stats.cow_reuses);
+    printk("Clone %d pages + touch %d: COW %lu cycles, eager %lu cycles\n", 
+     COW_PAGES, COW_TOUCHED, (unsigned long) cow, (unsigned long) eager);
+}
+
+#define WALK_ITERATIONS 100000
+
+void page_walk_test() {
+    uint64_t *heap, start, cycles, phys;
+    int i, ok = 1;
+
+    printk("\nTesting page table walks\n");
+    heap = MMU_alloc_pages_flags(16, MMU_MAP_WRITE | MMU_MAP_POPULATE);
+    *heap = 0x5A5A;
+
+    /* The direct map alias must reach the same frame. */
+    phys = MMU_translate(NULL, heap);
+    if (!phys || *(uint64_t *) phys_to_virt(phys) != 0x5A5A || 
+     MMU_translate(NULL, phys_to_virt(phys)) != phys)
+        ok = 0;
+
+    start = rdtsc();
+    for (i = 0; i < WALK_ITERATIONS; i++)
+        phys += MMU_translate(NULL, (char *) heap + (i % 16) * PAGE_SIZE);
+    cycles = rdtsc() - start;
+
+    MMU_free_pages(heap, 16);
+    printk("Direct map %s, %d walks in %lu cycles (%lu per walk)\n", 
+     ok ? "consistent" : "NOT consistent", WALK_ITERATIONS, 
+     (unsigned long) cycles, (unsigned long) (cycles / WALK_ITERATIONS));
+}
+
 void kmalloc_test() {
     char *test;
     int i, debug;
@@ -182,13 +594,484 @@ void kmalloc_test() {
     }
 }
 
+void slab_test() {
+    SLAB_stats before, after;
+    char *objs[64], *big;
+    int i, ok = 1;
+
+    printk("\nTesting slab allocator\n");
+    SLAB_get_stats(1, &before); /* 32 byte class. */
+    for (i = 0; i < 64; i++) {
+        objs[i] = kmalloc(17 + i % 16);
+        if ((uint64_t) objs[i] % 16 || SLAB_size(objs[i]) != 32)
+            ok = 0;
+        memset(objs[i], i, 17);
+    }
+    SLAB_get_stats(1, &after);
+    if (after.active != before.active + 64)
+        ok = 0;
+
+    for (i = 0; i < 64; i++) {
+        if (objs[i][16] != i) /* Overlapping objects. */
+            ok = 0;
+        kfree(objs[i]);
+    }
+    SLAB_get_stats(1, &after);
+    if (after.active != before.active)
+        ok = 0;
+
+    /* Past SLAB_MAX_SIZE objects are whole pages. */
+    big = kmalloc(SLAB_MAX_SIZE + 1);
+    if (SLAB_size(big) || (uint64_t) big % PAGE_SIZE)
+        ok = 0;
+    big = krealloc(big, 16);
+    if (SLAB_size(big) != 16)
+        ok = 0;
+    kfree(big);
+
+    printk("Slab objects %s, %lu slabs of 32 bytes\n", 
+     ok ? "sized" : "NOT sized", (unsigned long) after.slabs);
+}
+
+void list_heap_test() {
+    char *a, *b, *c, *merged;
+    int ok = 1;
+
+    printk("\nTesting list heap coalescing\n");
+    /* A freed block is reused first, so the next three are adjacent. */
+    kfree(kmalloc(3 * 64 + 2 * 32));
+    a = kmalloc(64);
+    b = kmalloc(64);
+    c = kmalloc(64);
+    kfree(a);
+    kfree(c);
+    kfree(b); /* Merges with both neighbours. */
+
+    /* The three blocks and the two tags between them are one block again. */
+    merged = kmalloc(3 * 64 + 2 * 32);
+    if (merged != a)
+        ok = 0;
+
+    /* Growing into a free neighbour keeps the block in place. */
+    a = krealloc(merged, 64);
+    b = krealloc(a, 128);
+    if (a != merged || b != merged)
+        ok = 0;
+    kfree(b);
+
+    printk("Free neighbours %s\n", ok ? "merged" : "NOT merged");
+}
+
+void heap_trim_test() {
+    char *start, *pages;
+    int ok = 1;
+#ifndef KHEAP_SLAB
+    char *burst[TRIM_TEST_BLOCKS];
+    int i;
+#endif
+
+    printk("\nTesting heap trimming\n");
+    start = kbrk(0);
+    pages = kbrk(4 * PAGE_SIZE);
+    memset(pages, 1, 4 * PAGE_SIZE);
+    if (kbrk(-4 * PAGE_SIZE) != start + 4 * PAGE_SIZE || kbrk(0) != start || 
+     MMU_translate(NULL, pages))
+        ok = 0;
+
+#ifndef KHEAP_SLAB
+    /* A freed burst goes back, the allocator keeps some slack. */
+    for (i = 0; i < TRIM_TEST_BLOCKS; i++) {
+        burst[i] = kmalloc(0x8000);
+        memset(burst[i], 1, 0x8000);
+    }
+    if ((char *) kbrk(0) <= start + TRIM_TEST_SLACK + PAGE_SIZE)
+        ok = 0; /* The burst did not come from kbrk(), nothing to trim. */
+    for (i = 0; i < TRIM_TEST_BLOCKS; i++)
+        kfree(burst[i]);
+    kmalloc_trim();
+    if ((char *) kbrk(0) > start + TRIM_TEST_SLACK + PAGE_SIZE)
+        ok = 0;
+#endif
+
+    printk("Heap break %s\n", ok ? "came back down" : "did NOT come back down");
+}
+
+void large_realloc_test() {
+    uint64_t *buf, *grown, phys, start, cycles;
+    uint64_t last = LARGE_TEST_SIZE / sizeof(uint64_t) - 1;
+    void *blocker, *frame;
+    int ok = 1;
+
+    printk("\nTesting large krealloc\n");
+    buf = kmalloc(LARGE_TEST_SIZE);
+    buf[0] = 0x1234;
+    buf[last] = 0x5678;
+    phys = MMU_translate(NULL, buf);
+
+    /* Usually lands right after |buf|, so the mapping has to move. */
+    blocker = MMU_alloc_pages(LARGE_TEST_SIZE / PAGE_SIZE);
+    start = rdtsc();
+    grown = krealloc(buf, 2 * LARGE_TEST_SIZE);
+    cycles = rdtsc() - start;
+    MMU_free_pages(blocker, LARGE_TEST_SIZE / PAGE_SIZE);
+
+    if (!grown || MMU_translate(NULL, grown) != phys || grown[0] != 0x1234 || 
+     grown[last] != 0x5678)
+        ok = 0;
+    printk("16 MiB grown to 32 MiB %s in %lu cycles\n", 
+     grown == buf ? "in place" : "by moving the mapping", 
+     (unsigned long) cycles);
+
+    /* Shrinking and growing again keeps the same frames. */
+    buf = krealloc(grown, LARGE_TEST_SIZE);
+    grown = krealloc(buf, 2 * LARGE_TEST_SIZE);
+    if (!grown || MMU_translate(NULL, grown) != phys || grown[last] != 0x5678)
+        ok = 0;
+    grown[2 * last] = 1;
+    kfree(grown);
+
+    /* The direct map uses large pages, so nothing can move into it. */
+    buf = MMU_alloc_page();
+    *buf = 0x4321;
+    frame = MMU_pf_alloc();
+    if (MMU_move_range(buf, phys_to_virt((uint64_t) frame), PAGE_SIZE) != 
+     EXIT_FAILURE || MMU_translate(NULL, buf) == 0 || *buf != 0x4321)
+        ok = 0;
+    MMU_pf_free(frame);
+    MMU_free_page(buf);
+
+    printk("Large blocks %s\n", ok ? "kept their pages" : "were NOT kept");
+}
+
+void kmalloc_aligned_test() {
+    static const size_t sizes[] = {1, 24, 100, 1000, 4000, 0x10000};
+    char *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+    size_t align;
+    unsigned int i;
+    int ok = 1;
+
+    printk("\nTesting kmalloc_aligned\n");
+    for (align = 32; align <= PAGE_SIZE; align <<= 1) {
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            ptrs[i] = kmalloc_aligned(sizes[i], align);
+            if (!ptrs[i] || (uint64_t) ptrs[i] % align)
+                ok = 0;
+            else
+                memset(ptrs[i], i, sizes[i]);
+        }
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            if (ptrs[i] && (ptrs[i][0] != (char) i || 
+             ptrs[i][sizes[i] - 1] != (char) i))
+                ok = 0;
+            kfree(ptrs[i]);
+        }
+    }
+
+    ptrs[0] = kmalloc_cacheline(40);
+    if (!ptrs[0] || (uint64_t) ptrs[0] % CACHE_LINE_SIZE)
+        ok = 0;
+    kfree(ptrs[0]);
+
+    if (kmalloc_aligned(16, 48) || kmalloc_aligned(16, 2 * PAGE_SIZE))
+        ok = 0;
+
+    printk("Aligned blocks %s\n", ok ? "were aligned" : "were NOT aligned");
+}
+
+void dma_test() {
+    static const size_t sizes[] = {1, PAGE_SIZE, 5000, 0x10000, 0x100000};
+    uint64_t phys, span;
+    unsigned int i, j;
+    char *buf;
+    int ok = 1;
+
+    printk("\nTesting dma_alloc\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        buf = dma_alloc(sizes[i], &phys);
+        if (!buf) {
+            ok = 0;
+            continue;
+        }
+
+        /* Blocks are a power of two pages aligned to their size. */
+        for (span = PAGE_SIZE; span < sizes[i]; span <<= 1)
+            ;
+        if (phys % span || buf[0] || buf[sizes[i] - 1])
+            ok = 0;
+        for (j = 0; j < span / PAGE_SIZE; j++)
+            if (MMU_translate(NULL, buf + j * PAGE_SIZE) != 
+             phys + j * PAGE_SIZE)
+                ok = 0;
+        memset(buf, 0xAB, sizes[i]);
+        dma_free(buf);
+    }
+
+    if (dma_alloc(2 * (PAGE_SIZE << PF_MAX_ORDER), &phys))
+        ok = 0;
+
+    printk("DMA buffers %s\n", ok ? "were contiguous" : "were NOT contiguous");
+}
+
+#define KPROF_TEST_BLOCKS 16
+
+void kprof_test() {
+    void *ptrs[KPROF_TEST_BLOCKS];
+    KPROF_site site, other;
+    int i, ok = 1;
+
+    printk("\nTesting kprof\n");
+    for (i = 0; i < KPROF_TEST_BLOCKS; i++)
+        ptrs[i] = kmalloc(100);
+
+    /* Every block came from the same call site, new to the profiler. */
+    if (KPROF_ptr_site(ptrs[0], &site) != EXIT_SUCCESS || 
+     site.allocs != KPROF_TEST_BLOCKS || site.live != KPROF_TEST_BLOCKS || 
+     site.live_bytes != 100 * KPROF_TEST_BLOCKS)
+        ok = 0;
+    for (i = 1; i < KPROF_TEST_BLOCKS; i++)
+        if (KPROF_ptr_site(ptrs[i], &other) != EXIT_SUCCESS || 
+         other.caller != site.caller)
+            ok = 0;
+
+    for (i = 0; i < KPROF_TEST_BLOCKS / 2; i++)
+        kfree(ptrs[i]);
+    if (KPROF_ptr_site(ptrs[0], &other) == EXIT_SUCCESS)
+        ok = 0;
+
+    /* A resized block belongs to the krealloc() call. */
+    ptrs[0] = krealloc(ptrs[KPROF_TEST_BLOCKS / 2], 200);
+    ptrs[KPROF_TEST_BLOCKS / 2] = NULL;
+    if (KPROF_ptr_site(ptrs[0], &other) != EXIT_SUCCESS || 
+     other.caller == site.caller || other.live_bytes != 200)
+        ok = 0;
+    KPROF_ptr_site(ptrs[KPROF_TEST_BLOCKS - 1], &site);
+    if (site.live != KPROF_TEST_BLOCKS / 2 - 1 || 
+     site.live_bytes != 100 * (KPROF_TEST_BLOCKS / 2 - 1))
+        ok = 0;
+
+    KPROF_dump(5, 0);
+    for (i = 0; i < KPROF_TEST_BLOCKS; i++)
+        if (i == 0 || i > KPROF_TEST_BLOCKS / 2)
+            kfree(ptrs[i]);
+
+    printk("Call sites %s\n", ok ? "were counted" : "were NOT counted");
+}
+
+struct cache_test_obj {
+    uint64_t magic;
+    char data[40];
+};
+
+static void cache_test_ctor(void *obj) {
+
+    ((struct cache_test_obj *) obj)->magic = 0xC0FFEE;
+}
+
+void kmem_cache_test() {
+    struct kmem_cache *cache;
+    struct cache_test_obj *objs[32];
+    SLAB_stats stats;
+    int i, ok = 1;
+
+    printk("\nTesting kmem_cache\n");
+    cache = kmem_cache_create("cache_test", sizeof(struct cache_test_obj), 64, 
+     cache_test_ctor);
+    for (i = 0; i < 32; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        if ((uint64_t) objs[i] % 64 || objs[i]->magic != 0xC0FFEE)
+            ok = 0;
+        memset(objs[i]->data, i, sizeof(objs[i]->data));
+    }
+
+    kmem_cache_stats(cache, &stats);
+    if (stats.active != 32 || !stats.slabs || 
+     kmem_cache_destroy(cache) == EXIT_SUCCESS) /* Objects still live. */
+        ok = 0;
+
+    /* Freed objects come back still constructed. */
+    for (i = 0; i < 32; i++)
+        kmem_cache_free(cache, objs[i]);
+    for (i = 0; i < 32; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        if (objs[i]->magic != 0xC0FFEE)
+            ok = 0;
+    }
+    for (i = 0; i < 32; i++)
+        kmem_cache_free(cache, objs[i]);
+
+    kmem_cache_dump();
+    if (kmem_cache_destroy(cache) != EXIT_SUCCESS)
+        ok = 0;
+    printk("Cache objects %s\n", ok ? "constructed" : "NOT constructed");
+}
+
+/* kmalloc_bench() times filling the heap with |live| 32 byte objects and then
+ * freeing them all.
+ */
+static void kmalloc_bench(unsigned long live) {
+    uint64_t start, alloc_cycles, free_cycles, pages;
+    void **objs;
+    unsigned long i;
+
+    pages = (live * sizeof(void *) + PAGE_SIZE - 1) / PAGE_SIZE;
+    objs = MMU_alloc_pages(pages);
+
+    start = rdtsc();
+    for (i = 0; i < live; i++)
+        objs[i] = kmalloc(32);
+    alloc_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < live; i++)
+        kfree(objs[i]);
+    free_cycles = rdtsc() - start;
+
+    printk("%lu live objects: kmalloc %lu cycles, kfree %lu cycles\n", live, 
+     (unsigned long) (alloc_cycles / live), 
+     (unsigned long) (free_cycles / live));
+    MMU_free_pages(objs, pages);
+}
+
+void kmalloc_bench_test() {
+
+    printk("\nBenchmarking kmalloc\n");
+    kmalloc_bench(10000);
+    kmalloc_bench(1000000);
+}
+
+/* kmalloc_cpu_bench() times batches of 64 byte kmalloc() and kfree() calls on
+ * the executing CPU and counts how often they took the shared slab lock.
+ */
+static void kmalloc_cpu_bench(void) {
+    void *objs[CPU_BENCH_BATCH];
+    uint64_t start, cycles, ops = 2ULL * CPU_BENCH_ROUNDS * CPU_BENCH_BATCH;
+    SLAB_stats before, after;
+    int round, i;
+
+    SLAB_get_stats(3, &before); /* 64 byte class. */
+    start = rdtsc();
+    for (round = 0; round < CPU_BENCH_ROUNDS; round++) {
+        for (i = 0; i < CPU_BENCH_BATCH; i++)
+            objs[i] = kmalloc(64);
+        for (i = 0; i < CPU_BENCH_BATCH; i++)
+            kfree(objs[i]);
+    }
+    cycles = rdtsc() - start;
+    SLAB_get_stats(3, &after);
+
+    printk("cpu %u: %lu kmalloc and kfree calls per Mcycle", cpu_id(), 
+     (unsigned long) (ops * 1000000 / cycles));
+#ifdef KHEAP_SLAB
+    printk(", %lu lock acquisitions per 1000", (unsigned long) 
+     ((after.refills + after.drains - before.refills - before.drains) * 
+     1000 / ops));
+#endif
+    printk("\n");
+}
+
+/* kmalloc_smp_bench_test() runs kmalloc_cpu_bench() on each CPU that is up.
+ * Total throughput scales with the cores for as long as the lock is rare.
+ */
+void kmalloc_smp_bench_test() {
+
+    printk("\nBenchmarking kmalloc per CPU\n");
+    kmalloc_cpu_bench();
+    printk("Application processors are not started, 1 of %d cores ran\n", 
+     MAX_CPUS);
+}
+
+struct irq_test {
+    void *slots[IRQ_TEST_SLOTS];
+    uint64_t total;
+    uint64_t worst;
+};
+
+/* kmalloc_irq_handler() replaces a random live block, timing the kfree() and
+ * kmalloc() from interrupt context.
+ */
+static void kmalloc_irq_handler(int irq, int error, void *arg) {
+    struct irq_test *test = arg;
+    void **slot = &test->slots[krand() % IRQ_TEST_SLOTS];
+    size_t size = krand() % IRQ_TEST_MAX_SIZE + 1;
+    uint64_t start, cycles;
+
+    start = rdtsc();
+    kfree(*slot);
+    *slot = kmalloc(size);
+    cycles = rdtsc() - start;
+
+    test->total += cycles;
+    if (cycles > test->worst)
+        test->worst = cycles;
+}
+
+void kmalloc_irq_test() {
+    static struct irq_test test;
+#ifdef KHEAP_TLSF
+    char *brk;
+#endif
+    int i;
+
+    printk("\nTesting kmalloc latency in interrupt context\n");
+#ifdef KHEAP_TLSF
+    /* Keep kbrk() out of the handler. */
+    TLSF_reserve(2 * IRQ_TEST_SLOTS * IRQ_TEST_MAX_SIZE);
+    brk = kbrk(0);
+#endif
+    memset(&test, 0, sizeof(test));
+    IRQ_set_handler(IRQ_TEST_INT, kmalloc_irq_handler, &test);
+
+    for (i = 0; i < IRQ_TEST_ROUNDS; i++)
+        asm volatile ( IRQ_TEST_INT_ASM );
+
+    IRQ_set_handler(IRQ_TEST_INT, NULL, NULL);
+    for (i = 0; i < IRQ_TEST_SLOTS; i++)
+        kfree(test.slots[i]);
+
+    printk("%d kfree and kmalloc pairs: %lu cycles average, %lu worst\n", 
+     IRQ_TEST_ROUNDS, (unsigned long) (test.total / IRQ_TEST_ROUNDS), 
+     (unsigned long) test.worst);
+#ifdef KHEAP_TLSF
+    printk("Heap break %s in the handler\n", 
+     kbrk(0) == brk ? "stayed put" : "MOVED");
+#endif
+}
+
 void run_all_tests() {
     vga_driver_tests();
     stdio_tests();
     ps2_tests();
     keyboard_tests();
     page_fault_test();
+    buddy_alloc_test();
+    pf_magazine_test();
+    page_desc_test();
+    numa_test();
+    zero_pool_test();
     page_frame_alloc_test();
     page_alloc_test();
+    fault_around_test();
+    vmem_test();
+    kstack_cache_test();
+    addr_space_test();
+    pcid_exhaust_test();
+    cow_clone_test();
+    page_walk_test();
     kmalloc_test();
+#ifdef KHEAP_SLAB
+    slab_test();
+#elif defined(KHEAP_LIST)
+    list_heap_test();
+#endif
+    heap_trim_test();
+    large_realloc_test();
+    kmalloc_aligned_test();
+    dma_test();
+#if KPROF
+    kprof_test();
+#endif
+    kmem_cache_test();
+    kmalloc_bench_test();
+    kmalloc_irq_test();
+    kmalloc_smp_bench_test();
 }
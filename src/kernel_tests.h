@@ -8,8 +8,31 @@ void ps2_tests();
 void keyboard_tests();
 void page_fault_test();
 void page_frame_alloc_test();
+void buddy_alloc_test();
+void pf_magazine_test();
+void page_desc_test();
+void numa_test();
+void zero_pool_test();
 void page_alloc_test();
+void fault_around_test();
+void vmem_test();
+void kstack_cache_test();
+void addr_space_test();
+void pcid_exhaust_test();
+void cow_clone_test();
+void page_walk_test();
 void virutal_addr_tests();
 void kmalloc_test();
+void slab_test();
+void list_heap_test();
+void heap_trim_test();
+void large_realloc_test();
+void kmalloc_aligned_test();
+void dma_test();
+void kprof_test();
+void kmem_cache_test();
+void kmalloc_bench_test();
+void kmalloc_irq_test();
+void kmalloc_smp_bench_test();
 
 #endif
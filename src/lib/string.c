@@ -23,6 +23,17 @@ extern void *memcpy(void *dest, const void *src, size_t n) {
     return (void *) src;
 }
 
+extern int memcmp(const void *s1, const void *s2, size_t n) {
+    const unsigned char *a = s1, *b = s2;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return a[i] - b[i];
+
+    return 0;
+}
+
 extern size_t strlen(const char *s) {
     size_t len;
 
@@ -0,0 +1,259 @@
+/**
+ * @file
+ */
+#include "acpi.h"
+#include "memory.h"
+#include "../lib/string.h"
+#include "../lib/stdlib.h"
+
+#define RSDP_V1_SIZE 20 /* Bytes covered by the ACPI 1.0 checksum. */
+#define SRAT_ENTRIES 48 /* Header plus 12 reserved bytes. */
+#define SLIT_ENTRIES 44 /* Header plus the locality count. */
+
+/* SRAT entry types. */
+#define SRAT_CPU 0
+#define SRAT_MEM 1
+#define SRAT_X2APIC 2
+
+#define SRAT_ENABLED 0x1 /* Entries without it must be ignored. */
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) srat_entry;
+
+/** @brief SRAT Processor Local APIC Affinity entry. */
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_cpu;
+
+/** @brief SRAT Memory Affinity entry. */
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) srat_mem;
+
+/** @brief SRAT Processor Local x2APIC Affinity entry. */
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) srat_x2apic;
+
+/** @brief Returns 1 if the |len| bytes at |ptr| sum to zero. */
+static int checksum_ok(const void *ptr, uint32_t len) {
+    const uint8_t *byte = ptr;
+    uint8_t sum = 0;
+
+    while (len--)
+        sum += *byte++;
+
+    return !sum;
+}
+
+/** @brief Finds a system description table by signature.
+ *
+ * Walks the XSDT if the RSDP has one and the RSDT otherwise.
+ * @param rsdp a copy of the RSDP.
+ * @param rsdp_size the number of valid bytes at |rsdp|.
+ * @param signature the four character signature, e.g. "SRAT".
+ * @returns A pointer to the table, or NULL if it is missing or corrupt.
+ * @pre phys_to_virt() reaches the ACPI tables.
+ */
+void *ACPI_find_table(const void *rsdp, int rsdp_size, const char *signature) {
+    const ACPI_rsdp *root = rsdp;
+    ACPI_sdt_header *sdt, *table;
+    uint64_t addr;
+    uint32_t addr32;
+    int entry_size, i, count;
+
+    if (rsdp_size < RSDP_V1_SIZE || memcmp(root->signature, "RSD PTR ", 8) || 
+     !checksum_ok(root, RSDP_V1_SIZE))
+        return NULL;
+
+    if (root->revision >= 2 && rsdp_size >= sizeof(ACPI_rsdp) && 
+     root->xsdt_address) {
+        sdt = phys_to_virt(root->xsdt_address);
+        entry_size = sizeof(uint64_t);
+    }
+    else {
+        sdt = phys_to_virt(root->rsdt_address);
+        entry_size = sizeof(uint32_t);
+    }
+
+    if (!checksum_ok(sdt, sdt->length))
+        return NULL;
+
+    count = (sdt->length - sizeof(ACPI_sdt_header)) / entry_size;
+    for (i = 0; i < count; i++) {
+        /* XSDT entries are only 4 byte aligned. */
+        if (entry_size == sizeof(uint64_t))
+            memcpy(&addr, (uint8_t *) (sdt + 1) + i * entry_size, entry_size);
+        else {
+            memcpy(&addr32, (uint8_t *) (sdt + 1) + i * entry_size, 
+             entry_size);
+            addr = addr32;
+        }
+
+        table = phys_to_virt(addr);
+        if (!memcmp(table->signature, signature, 4) && 
+         checksum_ok(table, table->length))
+            return table;
+    }
+
+    return NULL;
+}
+
+/** @brief Returns the node of proximity domain |domain|, adding it if new.
+ *
+ * Domains past ACPI_MAX_NODES share node 0.
+ */
+static int domain_node(ACPI_numa_info *info, uint32_t domain) {
+    int node;
+
+    for (node = 0; node < info->num_nodes; node++)
+        if (info->domains[node] == domain)
+            return node;
+
+    if (info->num_nodes == ACPI_MAX_NODES)
+        return 0;
+
+    info->domains[info->num_nodes] = domain;
+
+    return info->num_nodes++;
+}
+
+/** @brief Records that the CPU with local APIC |apic_id| is on |node|. */
+static void add_cpu(ACPI_numa_info *info, uint32_t apic_id, int node) {
+
+    if (info->num_cpus < ACPI_MAX_CPUS) {
+        info->apic_ids[info->num_cpus] = apic_id;
+        info->cpu_nodes[info->num_cpus] = node;
+        info->num_cpus++;
+    }
+}
+
+/** @brief Fills in the distances between nodes from the SLIT.
+ *
+ * Without a SLIT every remote node is ACPI_REMOTE_DISTANCE away.
+ */
+static void parse_slit(const void *rsdp, int rsdp_size, 
+ ACPI_numa_info *info) {
+    ACPI_sdt_header *slit;
+    uint8_t *entries;
+    uint64_t localities;
+    uint32_t from, to;
+    int i, j;
+
+    for (i = 0; i < info->num_nodes; i++)
+        for (j = 0; j < info->num_nodes; j++)
+            info->distance[i][j] = i == j ? ACPI_LOCAL_DISTANCE : 
+             ACPI_REMOTE_DISTANCE;
+
+    slit = ACPI_find_table(rsdp, rsdp_size, "SLIT");
+    if (!slit || slit->length < SLIT_ENTRIES)
+        return;
+
+    memcpy(&localities, slit + 1, sizeof(uint64_t));
+    if (slit->length < SLIT_ENTRIES + localities * localities)
+        return;
+
+    /* The SLIT is indexed by proximity domain. */
+    entries = (uint8_t *) slit + SLIT_ENTRIES;
+    for (i = 0; i < info->num_nodes; i++) {
+        from = info->domains[i];
+        for (j = 0; j < info->num_nodes; j++) {
+            to = info->domains[j];
+            if (from < localities && to < localities)
+                info->distance[i][j] = entries[from * localities + to];
+        }
+    }
+}
+
+/** @brief Reads the NUMA topology from the SRAT and SLIT.
+ *
+ * @param rsdp a copy of the RSDP.
+ * @param rsdp_size the number of valid bytes at |rsdp|.
+ * @param info filled in with the nodes, their memory and CPUs, and the
+ * distances between them.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if there is no SRAT or it describes
+ * no nodes.
+ * @pre phys_to_virt() reaches the ACPI tables.
+ */
+int ACPI_parse_numa(const void *rsdp, int rsdp_size, ACPI_numa_info *info) {
+    ACPI_sdt_header *srat;
+    uint8_t *ptr, *end;
+    srat_entry *entry;
+    srat_cpu *cpu;
+    srat_mem *mem;
+    srat_x2apic *x2apic;
+    uint32_t domain;
+
+    memset(info, 0, sizeof(ACPI_numa_info));
+
+    srat = ACPI_find_table(rsdp, rsdp_size, "SRAT");
+    if (!srat)
+        return EXIT_FAILURE;
+
+    ptr = (uint8_t *) srat + SRAT_ENTRIES;
+    end = (uint8_t *) srat + srat->length;
+    for (; ptr + sizeof(srat_entry) <= end; ptr += entry->length) {
+        entry = (srat_entry *) ptr;
+        if (entry->length < sizeof(srat_entry) || ptr + entry->length > end)
+            break;
+
+        if (entry->type == SRAT_CPU && entry->length >= sizeof(srat_cpu)) {
+            cpu = (srat_cpu *) entry;
+            if (!(cpu->flags & SRAT_ENABLED))
+                continue;
+
+            domain = cpu->domain_low | cpu->domain_high[0] << 8 | 
+             cpu->domain_high[1] << 16 | (uint32_t) cpu->domain_high[2] << 24;
+            add_cpu(info, cpu->apic_id, domain_node(info, domain));
+        }
+        else if (entry->type == SRAT_X2APIC && 
+         entry->length >= sizeof(srat_x2apic)) {
+            x2apic = (srat_x2apic *) entry;
+            if (x2apic->flags & SRAT_ENABLED)
+                add_cpu(info, x2apic->x2apic_id, 
+                 domain_node(info, x2apic->domain));
+        }
+        else if (entry->type == SRAT_MEM && entry->length >= sizeof(srat_mem)) {
+            mem = (srat_mem *) entry;
+            if (!(mem->flags & SRAT_ENABLED) || !mem->size || 
+             info->num_mem == ACPI_MAX_MEM_RANGES)
+                continue;
+
+            info->mem[info->num_mem].base = mem->base;
+            info->mem[info->num_mem].length = mem->size;
+            info->mem[info->num_mem].node = domain_node(info, mem->domain);
+            info->num_mem++;
+        }
+    }
+
+    if (!info->num_nodes)
+        return EXIT_FAILURE;
+
+    parse_slit(rsdp, rsdp_size, info);
+
+    return EXIT_SUCCESS;
+}
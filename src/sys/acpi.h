@@ -0,0 +1,64 @@
+#ifndef _ACPI_H
+#define _ACPI_H
+
+#include "../lib/stdint.h"
+
+#define ACPI_MAX_NODES 8 /* NUMA nodes tracked, extra domains fold into 0. */
+#define ACPI_MAX_MEM_RANGES 32
+#define ACPI_MAX_CPUS 64
+#define ACPI_LOCAL_DISTANCE 10 /* SLIT distance of a node to itself. */
+#define ACPI_REMOTE_DISTANCE 20 /* Assumed between nodes without a SLIT. */
+
+/** @brief Root System Description Pointer. */
+typedef struct {
+    char signature[8]; /* "RSD PTR ". */
+    uint8_t checksum;  /* Covers the first 20 bytes. */
+    char oem_id[6];
+    uint8_t revision;  /* 0 for ACPI 1.0, 2 for 2.0 and later. */
+    uint32_t rsdt_address;
+    uint32_t length;   /* The fields below are only valid from 2.0. */
+    uint64_t xsdt_address;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) ACPI_rsdp;
+
+/** @brief Header shared by every system description table. */
+typedef struct {
+    char signature[4];
+    uint32_t length; /* Including the header. */
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) ACPI_sdt_header;
+
+/** @brief Physical memory range of one node. */
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    int node;
+} ACPI_mem_range;
+
+/** @brief NUMA topology from the SRAT and SLIT.
+ *
+ * Proximity domains are renumbered 0 to num_nodes - 1 in the order the SRAT
+ * lists them.
+ */
+typedef struct {
+    int num_nodes;
+    uint32_t domains[ACPI_MAX_NODES]; /* Proximity domain of each node. */
+    ACPI_mem_range mem[ACPI_MAX_MEM_RANGES];
+    int num_mem;
+    uint32_t apic_ids[ACPI_MAX_CPUS];
+    int cpu_nodes[ACPI_MAX_CPUS]; /* Node of the CPU in |apic_ids|. */
+    int num_cpus;
+    uint8_t distance[ACPI_MAX_NODES][ACPI_MAX_NODES];
+} ACPI_numa_info;
+
+void *ACPI_find_table(const void *rsdp, int rsdp_size, const char *signature);
+int ACPI_parse_numa(const void *rsdp, int rsdp_size, ACPI_numa_info *info);
+
+#endif
@@ -0,0 +1,105 @@
+/**
+ * @file
+ */
+#ifndef _CPU_H
+#define _CPU_H
+
+#include "../lib/stdint.h"
+
+#define MAX_CPUS 8
+
+#define CPUID_FEATURES 0x1
+#define CPUID_PCID (1U << 17)      /* ECX: process-context identifiers. */
+#define CPUID_PGE (1U << 13)       /* EDX: global pages. */
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_EXT_PDPE1GB (1U << 26) /* EDX: 1 GiB pages. */
+
+typedef volatile int spinlock_t;
+
+/** @brief Returns the index of the executing CPU.
+ *
+ * Only the bootstrap processor is brought up, so this is always 0 until AP 
+ * startup exists.
+ */
+static inline unsigned int cpu_id(void) {
+
+    return 0;
+}
+
+/** @brief Executes CPUID for |leaf| with subleaf 0. */
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, 
+ uint32_t *ecx, uint32_t *edx) {
+
+    asm volatile ( "cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) 
+     : "a"(leaf), "c"(0) );
+}
+
+/** @brief Reads the CR0 register. */
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+
+    asm volatile ( "movq %%cr0, %0" : "=r"(cr0) );
+
+    return cr0;
+}
+
+/** @brief Writes the CR0 register. */
+static inline void write_cr0(uint64_t cr0) {
+
+    asm volatile ( "movq %0, %%cr0" : : "r"(cr0) : "memory" );
+}
+
+/** @brief Reads the CR3 register. */
+static inline uint64_t read_cr3(void) {
+    uint64_t cr3;
+
+    asm volatile ( "movq %%cr3, %0" : "=r"(cr3) );
+
+    return cr3;
+}
+
+/** @brief Writes the CR3 register. */
+static inline void write_cr3(uint64_t cr3) {
+
+    asm volatile ( "movq %0, %%cr3" : : "r"(cr3) : "memory" );
+}
+
+/** @brief Reads the CR4 register. */
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+
+    asm volatile ( "movq %%cr4, %0" : "=r"(cr4) );
+
+    return cr4;
+}
+
+/** @brief Writes the CR4 register. */
+static inline void write_cr4(uint64_t cr4) {
+
+    asm volatile ( "movq %0, %%cr4" : : "r"(cr4) : "memory" );
+}
+
+/** @brief Reads the time stamp counter. */
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+
+    asm volatile ( "rdtsc" : "=a"(low), "=d"(high) );
+
+    return ((uint64_t) high << 32) | low;
+}
+
+/** @brief Spins until |lock| is acquired. */
+static inline void spin_lock(spinlock_t *lock) {
+
+    while (__sync_lock_test_and_set(lock, 1))
+        while (*lock)
+            asm volatile ( "pause" );
+}
+
+/** @brief Releases |lock|. */
+static inline void spin_unlock(spinlock_t *lock) {
+
+    __sync_lock_release(lock);
+}
+
+#endif
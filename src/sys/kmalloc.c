@@ -8,15 +8,23 @@
 #include "../lib/debug.h"
 #include "kmalloc.h"
 #include "memory.h"
+#include "slab.h"
+#include "tlsf.h"
+#include "kprof.h"
 
 #define BUF_LEN 100
-#define BIG_ENOUGH 1
-#define PERFECT_SIZE 2
 #define DEFAULT_BLOCK_SIZE 0xFA00
+/* Free space at the end of the heap past TRIM_THRESHOLD goes back to kbrk(),
+ * all but TRIM_KEEP bytes of it, so a burst does not pin memory for good and
+ * the next one does not have to grow the heap again straight away.
+ */
+#define TRIM_THRESHOLD (4 * DEFAULT_BLOCK_SIZE)
+#define TRIM_KEEP LIST_TRIM_KEEP
 
 #define ALIGNMENT_CONST 16
-#define ALIGNED_BLOCK (sizeof(Block) + ALIGNMENT_CONST - sizeof(Block) % \
-    ALIGNMENT_CONST)
+#define ALIGNED_BLOCK ((sizeof(Block) + ALIGNMENT_CONST - 1) & \
+    ~(ALIGNMENT_CONST - 1))
+#define BLOCK_OVERHEAD (2 * ALIGNED_BLOCK) /* Header and footer */
 
 #define DEBUG_ENV "DEBUG_MALLOC"
 #define DEBUG_MALLOC "MALLOC: malloc(%d)\t=> (ptr=%p, size=%d)\n"
@@ -24,158 +32,431 @@
 #define DEBUG_CALLOC "MALLOC: calloc(%d,%d)\t=> (ptr=%p, size=%d)\n"
 #define DEBUG_REALLOC "MALLOC: realloc(%p,%d)\t=> (ptr=%p, size=%d)\n"
 
-static void *head = NULL;
 static char debug = 0;
 
-/* Struct for storing metadata about blocks */
+/* align_size() ensures that any value passed to it will be divisible by 16 */
+size_t align_size(size_t size) {
+
+    if (size % ALIGNMENT_CONST)
+        size += ALIGNMENT_CONST - size % ALIGNMENT_CONST;
+
+    return size;
+}
+
+#ifdef KHEAP_LIST
+
+/* Struct for storing metadata about blocks. Every block starts with one and
+ * ends with a copy of it, so the blocks on both sides of any block can be
+ * reached without walking the heap.
+ */
 typedef struct Block {
-    size_t size;
-    struct Block *next;
-    char free;
+    size_t size; /* Payload bytes between the header and the footer */
+    size_t free;
 } Block;
 
-/* find_header() finds the associated allocation unit for |ptr|. If |prev| is
- * nonnull, find_header() will set it to the previous allocation unit.
- */
-Block *find_header(void *ptr, Block **prev) {
-    Block *header = (Block *) head;
-
-    /* Find the allocation unit that |ptr| falls in */
-    while (header->next && header->next <= (Block *) ptr) {
-        if (prev)
-            *prev = header; /* Store the previous allocation unit */
-        header = header->next; /* Advance to next allocation unit */
-    }
+/* Links of a free block, kept at the start of its payload */
+typedef struct Links {
+    struct Block *next;
+    struct Block *prev;
+} Links;
 
-    return header;
+static Block *free_head = NULL; /* Free blocks, most recently freed first */
+static Block *heap_end = NULL;  /* Header of size 0 ending the heap */
+
+static inline Links *links(Block *block) {
+    return (Links *) ((char *) block + ALIGNED_BLOCK);
 }
 
-/* align_size() ensures that any value passed to it will be divisible by 16 */
-size_t align_size(size_t size) {
+static inline Block *footer(Block *block) {
+    return (Block *) ((char *) block + ALIGNED_BLOCK + block->size);
+}
 
-    if (size % ALIGNMENT_CONST)
-        size += ALIGNMENT_CONST - size % ALIGNMENT_CONST;
+static inline Block *next_block(Block *block) {
+    return (Block *) ((char *) footer(block) + ALIGNED_BLOCK);
+}
 
-    return size;
+/* prev_block() finds the block before |block| through its footer. */
+static inline Block *prev_block(Block *block) {
+    Block *tag = (Block *) ((char *) block - ALIGNED_BLOCK);
+
+    return (Block *) ((char *) tag - tag->size - ALIGNED_BLOCK);
+}
+
+/* set_block() writes both boundary tags of |block|. */
+static void set_block(Block *block, size_t size, size_t free) {
+    block->size = size;
+    block->free = free;
+    footer(block)->size = size;
+    footer(block)->free = free;
 }
 
-/* malloc() will first check to see if there already exits a free block of
- * appropriate size, and will segment that free block if necessary to not waste
- * space, and will return a pointer to the unused segment. If no suitable block
- * exists, kbrk() will be called to allocate more space.
+static void push_free(Block *block) {
+    links(block)->prev = NULL;
+    links(block)->next = free_head;
+    if (free_head)
+        links(free_head)->prev = block;
+    free_head = block;
+}
+
+static void remove_free(Block *block) {
+    Links *l = links(block);
+
+    if (l->prev)
+        links(l->prev)->next = l->next;
+    else
+        free_head = l->next;
+    if (l->next)
+        links(l->next)->prev = l->prev;
+}
+
+/* coalesce() merges the free |block|, which is not on the free list, with
+ * free neighbours and returns the merged block. A neighbour is free only
+ * if its tag says so; the tags at the ends of the heap never do.
  */
+static Block *coalesce(Block *block) {
+    Block *next = next_block(block), *prev;
 
-void *kmalloc(size_t size) {
-    void *brk, *ret;
-    Block *header, *temp;
-    short found = 0;
-    size_t oldsize, newsize;
-
-    /* Check if |size| is zero and return NULL if so */
-    if (size == 0) {
-        if (debug) {
-            printk(DEBUG_MALLOC, size, NULL, 0);
-        }
+    if (next->free) {
+        remove_free(next);
+        set_block(block, block->size + BLOCK_OVERHEAD + next->size, 1);
+    }
 
-        return NULL;
+    if (((Block *) ((char *) block - ALIGNED_BLOCK))->free) {
+        prev = prev_block(block);
+        remove_free(prev);
+        set_block(prev, prev->size + BLOCK_OVERHEAD + block->size, 1);
+        block = prev;
     }
 
-    /* Round up to a multiple of 16 if not already a multiple of 16 */
-    size = align_size(size);
+    return block;
+}
 
-    header = (Block *) head; /* Make the head of the linked list accessible */
-    while (header && !found) {
-        /* Check if the block is big enough */
-        if (header->free && header->size > size + ALIGNED_BLOCK) {
-            found = BIG_ENOUGH; /* Found a block bigger than what is needed */
-        }
-        else if (header->free && header->size == size) {
-            found = PERFECT_SIZE; /* Found a block exactly the right size */
-        }
+/* split() marks |block| used with a payload of |size| and puts whatever is
+ * left past it, if large enough to be a block, on the free list.
+ */
+static void split(Block *block, size_t size) {
+    Block *rest;
+    size_t left;
 
-        /* Advance to the next item in the list if usable block is not found */
-        if (!found)
-            header = header->next;
+    if (block->size < size + BLOCK_OVERHEAD + ALIGNMENT_CONST) {
+        set_block(block, block->size, 0);
+        return;
     }
 
-    if (header) { /* An appropriately sized block was found */
+    left = block->size - size - BLOCK_OVERHEAD;
+    set_block(block, size, 0);
+    rest = next_block(block);
+    set_block(rest, left, 1);
+    push_free(coalesce(rest));
+}
 
-        if (found == BIG_ENOUGH) {
-            header->free = 0; /* Mark block as not free */
-            oldsize = header->size; /* Store old size */
-            header->size = size; /* Set correct size */
+/* grow_heap() extends the heap with kbrk() by enough for a |size| byte
+ * payload and returns the new free block, merged with a free last block,
+ * or NULL if kbrk() fails. Memory that does not follow the end of the heap
+ * starts a new region with a tag of its own in front.
+ */
+static Block *grow_heap(size_t size) {
+    size_t newsize;
+    char *brk;
+    Block *block;
+
+    /* Leave room for a region's front tag in case the break moved */
+    newsize = size + BLOCK_OVERHEAD + 2 * ALIGNED_BLOCK;
+    if (newsize < DEFAULT_BLOCK_SIZE)
+        newsize = DEFAULT_BLOCK_SIZE;
+    /* kbrk() hands out whole pages, so ask for all of them */
+    newsize = (newsize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    brk = kbrk(newsize);
+    if (brk == (void *) -1)
+        return NULL;
 
-            /* Create a space for the next header */
-            temp = (Block *) (((char *) header) + size + ALIGNED_BLOCK);
-            temp->free = 1; /* Mark as free */
-            /* Set size as remaining size of the block */
+    if (heap_end && brk == (char *) heap_end + ALIGNED_BLOCK) {
+        /* The old end tag becomes the header of the new block */
+        block = heap_end;
+        newsize -= BLOCK_OVERHEAD;
+    }
+    else {
+        block = (Block *) brk;
+        block->size = 0;
+        block->free = 0;
+        block = (Block *) (brk + ALIGNED_BLOCK);
+        newsize -= BLOCK_OVERHEAD + 2 * ALIGNED_BLOCK;
+    }
 
-            temp->size = oldsize - size - ALIGNED_BLOCK; /* Set size */
-            /* Adjust the |next| pointers appropriately */
-            temp->next = header->next;
-            header->next = temp;
+    set_block(block, newsize, 1);
+    heap_end = next_block(block);
+    heap_end->size = 0;
+    heap_end->free = 0;
 
-            ret = (void *) ((char *) header + ALIGNED_BLOCK);
-        }
-        else if (found == PERFECT_SIZE) {
-            header->free = 0; /* Mark block as not free */
-            ret = (void *) ((char *) header + ALIGNED_BLOCK);
-        }
-        else {
-            printk("Nonnull header when block not found");
-            ret = NULL;
-        }
-    }
-    else { /* An appropriate block was not found */
+    return coalesce(block);
+}
 
-        /* Find the last block in the list */
-        temp = head;
-        while (temp && temp->next)
-            temp = temp->next;
+/* trim_heap() shrinks the free |block| at the end of the heap and gives the
+ * pages past it back with kbrk() once it is larger than TRIM_THRESHOLD.
+ */
+static void trim_heap(Block *block) {
+    size_t release;
 
-        /* Check to see if |size| is larger than DEFAULT_BLOCK_SIZE and request
-         * an appropriately sized block if so
-         */
-        if (size > DEFAULT_BLOCK_SIZE)
-            newsize = (size / DEFAULT_BLOCK_SIZE + 1) * DEFAULT_BLOCK_SIZE;
-        else /* Otherwise request the default sized block */
-            newsize = DEFAULT_BLOCK_SIZE;
+    if (block->size <= TRIM_THRESHOLD || 
+     kbrk(0) != (char *) heap_end + ALIGNED_BLOCK)
+        return;
+
+    release = (block->size - TRIM_KEEP) & ~(PAGE_SIZE - 1);
+    set_block(block, block->size - release, 1);
+    heap_end = next_block(block);
+    heap_end->size = 0;
+    heap_end->free = 0;
+
+    if (kbrk(-release) == (void *) -1)
+        printk("kbrk() error in kfree()\n");
+}
+
+/* list_malloc() takes the first free block that is large enough, splitting
+ * off what it does not need. If no suitable block exists, kbrk() is called
+ * to allocate more space.
+ */
+
+static void *list_malloc(size_t size) {
+    Block *block;
 
+    /* Round up to a multiple of 16; free blocks need room for their links */
+    size = align_size(size);
+
+    for (block = free_head; block && block->size < size; 
+     block = links(block)->next)
+        ;
 
-        brk = kbrk(newsize); /* Create a new free block */
-        if (brk == (void *) -1) {
+    if (block)
+        remove_free(block);
+    else {
+        block = grow_heap(size);
+        if (!block) {
             printk("kbrk() error in kmalloc()\n");
             return NULL;
         }
+    }
 
-        /* If the head of the linked list is NULL, set it equal to |brk|.
-         * This should only happen once the first time malloc() is called.
-         */
-        if (!head) {
-            head = brk;
+    split(block, size);
+
+    return (void *) ((char *) block + ALIGNED_BLOCK);
+}
+
+/* list_free() deallocates a block and merges it with adjacent free blocks if
+ * they exist.
+ */
+
+static void list_free(void *ptr) {
+    Block *block = (Block *) ((char *) ptr - ALIGNED_BLOCK);
+
+    /* |heap_end| should not be NULL. Throw an error and exit if it is. */
+    if (!heap_end) {
+        printk("Heap is empty");
+        HALT_CPU
+    }
+
+    if (block->free || footer(block)->size != block->size) {
+        printk("kfree: %p is free or corrupt\n", ptr);
+        HALT_CPU
+    }
+
+    set_block(block, block->size, 1);
+    block = coalesce(block);
+    if (next_block(block) == heap_end)
+        trim_heap(block);
+    push_free(block);
+}
+
+static size_t list_size(void *ptr) {
+
+    return ((Block *) ((char *) ptr - ALIGNED_BLOCK))->size;
+}
 
-            if (debug) {
-                printk("Setting |head| at %p\n", brk);
+/* list_realloc() resizes the block in place when it shrinks or the block
+ * after it is free and large enough, and moves it otherwise.
+ */
+
+static void *list_realloc(void *ptr, size_t size) {
+    Block *block = (Block *) ((char *) ptr - ALIGNED_BLOCK), *next;
+    void *ret;
+
+    size = align_size(size); /* Make sure |size| is aligned */
+
+    if (size > block->size) {
+        next = next_block(block);
+        if (!next->free || 
+         block->size + BLOCK_OVERHEAD + next->size < size) {
+            ret = list_malloc(size);
+            if (ret) {
+                /* Copy old data to new space */
+                memcpy(ret, ptr, block->size);
+                list_free(ptr);
             }
+            return ret;
         }
 
-        header = (Block *) brk; /* Set header for new allocation unit */
-        header->free = 0;
-        header->size = size; 
-        /* Set the address for the next allocation unit */
-        header->next = (Block *) ((char *) brk + size + ALIGNED_BLOCK);
-        if (temp) /* Make sure the previous block can access this block */
-            temp->next = header; 
+        /* Absorb the next block */
+        remove_free(next);
+        set_block(block, block->size + BLOCK_OVERHEAD + next->size, 0);
+    }
 
-        temp = header->next; /* Set |temp| to the last allocation unit */
-        temp->free = 1;
-        temp->size = newsize - (size + ALIGNED_BLOCK * 2);
-        temp->next = NULL; /* No allocations units exist after this one */
+    split(block, size); /* Give back what is no longer needed */
 
+    return ptr;
+}
 
-        ret = (void *) ((char *) header + ALIGNED_BLOCK);
+/* list_malloc_aligned() allocates enough to find an |align| boundary with
+ * room for a free block in front of it, then gives that block back.
+ */
+
+static void *list_malloc_aligned(size_t size, size_t align) {
+    Block *block, *front;
+    uint64_t ptr;
+    size_t gap, total;
+
+    size = align_size(size);
+    ptr = (uint64_t) list_malloc(size + align + BLOCK_OVERHEAD + 
+     ALIGNMENT_CONST);
+    if (!ptr)
+        return NULL;
+    block = (Block *) (ptr - ALIGNED_BLOCK);
+
+    /* A free block needs its tags and room for its links */
+    gap = ((ptr + align - 1) & ~(align - 1)) - ptr;
+    if (gap && gap < BLOCK_OVERHEAD + ALIGNMENT_CONST)
+        gap += align;
+
+    if (gap) {
+        total = block->size;
+        front = block;
+        set_block(front, gap - BLOCK_OVERHEAD, 1);
+        block = next_block(front);
+        set_block(block, total - gap, 0);
+        push_free(coalesce(front));
     }
 
+    split(block, size);
+
+    return (void *) ((char *) block + ALIGNED_BLOCK);
+}
+
+#endif
+
+#if defined(KHEAP_LIST)
+#define heap_malloc list_malloc
+#define heap_malloc_aligned list_malloc_aligned
+#define heap_free list_free
+#define heap_realloc list_realloc
+#define heap_size list_size
+#define LARGE_SIZE DEFAULT_BLOCK_SIZE
+#elif defined(KHEAP_TLSF)
+#define heap_malloc TLSF_alloc
+#define heap_malloc_aligned TLSF_alloc_aligned
+#define heap_free TLSF_free
+#define heap_realloc TLSF_realloc
+#define heap_size TLSF_size
+#define LARGE_SIZE DEFAULT_BLOCK_SIZE
+#else
+#define heap_malloc SLAB_alloc
+#define heap_malloc_aligned slab_malloc_aligned
+#define heap_free slab_free
+#define heap_realloc slab_realloc
+#define heap_size SLAB_size
+#define LARGE_SIZE SLAB_MAX_SIZE
+#endif
+
+#ifdef KHEAP_SLAB
+
+static void slab_free(void *ptr) {
+
+    if (SLAB_free(ptr) != EXIT_SUCCESS) {
+        printk("kfree: %p was not allocated\n", ptr);
+        HALT_CPU
+    }
+}
+
+/* slab_realloc() keeps the block unless it is too small or more than twice
+ * the size needed.
+ */
+
+static void *slab_realloc(void *ptr, size_t size) {
+    size_t old_size = SLAB_size(ptr);
+    void *ret;
+
+    if (size <= old_size && size > old_size / 2)
+        return ptr;
+
+    ret = SLAB_alloc(size);
+    if (ret) {
+        memcpy(ret, ptr, size < old_size ? size : old_size);
+        slab_free(ptr);
+    }
+
+    return ret;
+}
+
+/* slab_malloc_aligned() relies on power of two classes being aligned to
+ * their size.
+ */
+
+static void *slab_malloc_aligned(size_t size, size_t align) {
+
+    while (align < size)
+        align <<= 1;
+
+    return SLAB_alloc(align);
+}
+
+#endif
+
+/* Blocks larger than LARGE_SIZE get whole pages of their own from
+ * MMU_alloc_pages(), so they never fragment the heap and krealloc() can grow
+ * them by extending or moving their mapping instead of copying them.
+ */
+
+static inline int is_large(void *ptr) {
+
+    return (uint64_t) ptr >= KPAGES_ADDR && (uint64_t) ptr < USER_ADDR;
+}
+
+static inline unsigned int large_pages(size_t size) {
+
+    return (size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static void large_free(void *ptr) {
+    uint64_t size = MMU_pages_size(ptr);
+
+    if (!size) {
+        printk("kfree: %p was not allocated\n", ptr);
+        HALT_CPU
+    }
+    MMU_free_pages(ptr, size / PAGE_SIZE);
+}
+
+/* alloc_block() backs kmalloc() and the functions built on it, which
+ * record their own caller for the profiler.
+ */
+
+static void *alloc_block(size_t size) {
+
+    if (size > LARGE_SIZE)
+        return MMU_alloc_pages(large_pages(size));
+    else if (size)
+        return heap_malloc(size);
+
+    return NULL;
+}
+
+/* kmalloc() returns a block of at least |size| bytes aligned to 16 bytes, or
+ * NULL if |size| is zero or no memory is left.
+ */
+
+void *kmalloc(size_t size) {
+    void *ret = alloc_block(size);
+
+    KPROF_alloc(ret, size, __builtin_return_address(0));
+
     /* Check to see if the debugging environmental variable is set */
     if (debug) {
         printk(DEBUG_MALLOC, size, ret, size);
@@ -184,58 +465,126 @@ void *kmalloc(size_t size) {
     return ret;
 }
 
-/* free() deallocates a block and merges it with adjacent free blocks if they 
- * exist.
+/* alloc_aligned() backs kmalloc_aligned() and kmalloc_cacheline(). */
+
+static void *alloc_aligned(size_t size, size_t align) {
+    void *ret = NULL;
+
+    if (!align || align & (align - 1) || align > PAGE_SIZE)
+        return NULL;
+
+    /* Every block is aligned to 16 bytes, and pages to any |align| allowed */
+    if (align <= ALIGNMENT_CONST || size > LARGE_SIZE)
+        ret = alloc_block(size);
+    else if (size)
+        ret = heap_malloc_aligned(size, align);
+
+    if (debug) {
+        printk(DEBUG_MALLOC, size, ret, size);
+    }
+
+    return ret;
+}
+
+/* kmalloc_aligned() returns a block of at least |size| bytes at a multiple
+ * of |align|, which must be a power of two no larger than PAGE_SIZE, or NULL.
+ * kfree() releases it. krealloc() keeps only the alignment of kmalloc().
  */
 
-void kfree(void *ptr) {
-    Block *header, *temp = NULL;
+void *kmalloc_aligned(size_t size, size_t align) {
+    void *ret = alloc_aligned(size, align);
+
+    KPROF_alloc(ret, size, __builtin_return_address(0));
+
+    return ret;
+}
+
+/* kmalloc_cacheline() returns a block that starts and ends on cache line
+ * boundaries, so it shares no line with other blocks.
+ */
+
+void *kmalloc_cacheline(size_t size) {
+    void *ret;
+
+    size = (size + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+    ret = alloc_aligned(size, CACHE_LINE_SIZE);
+    KPROF_alloc(ret, size, __builtin_return_address(0));
+
+    return ret;
+}
+
+/* dma_alloc() returns zeroed, physically contiguous memory for a device and
+ * stores its physical address in |phys|. The block is a power of two pages
+ * from the page frame allocator, aligned to its size, so at most
+ * PAGE_SIZE << PF_MAX_ORDER bytes. Returns NULL if none is free.
+ */
+
+void *dma_alloc(size_t size, uint64_t *phys) {
+    unsigned int order = 0;
+    void *pf, *ret;
+
+    if (!size || size > (size_t) PAGE_SIZE << PF_MAX_ORDER)
+        return NULL;
+
+    while ((size_t) PAGE_SIZE << order < size)
+        order++;
+
+    pf = MMU_pf_alloc_order(order);
+    if (!pf)
+        return NULL;
+
+    ret = phys_to_virt((uint64_t) pf);
+    memset(ret, 0, (size_t) PAGE_SIZE << order);
+    if (phys)
+        *phys = (uint64_t) pf;
+
+    return ret;
+}
+
+/* dma_free() releases a block from dma_alloc(). */
+
+void dma_free(void *ptr) {
+    MEM_page *page;
+    void *pf;
 
-    /* Check to see if |ptr| is NULL and silently return if so */
     if (!ptr)
         return;
 
-    /* |head| should not be NULL. Throw an error and exit if it is. */
-    if (!head) {
-        printk("Linked list head is NULL");
+    pf = (void *) virt_to_phys(ptr);
+    page = MMU_pf_to_page(pf);
+    if (!page || !(page->flags & PG_HEAD) || 
+     MMU_pf_free_order(pf, page->order) != EXIT_SUCCESS) {
+        printk("dma_free: %p was not allocated\n", ptr);
         HALT_CPU
     }
+}
 
-    /* Search for the header that is at or just before |ptr| */
-    header = find_header(ptr, &temp);
-    header->free = 1; /* Set the block containing the address in |ptr| free */
+/* kmalloc_trim() gives free memory at the end of the heap back to kbrk().
+ * The TLSF heap only shrinks here, so that kfree() stays cheap in interrupt
+ * handlers. MMU_zero_thread() calls it whenever it goes idle; other callers
+ * must be in thread context too. The list heap shrinks in kfree().
+ */
 
-    /* Merging free blocks */
+void kmalloc_trim(void) {
 
-    /* Check if the next allocation unit is free */
-    if (header->next && header->next->free) {
-        /* Add the size of the next block to the current block size */
-        header->size += header->next->size + ALIGNED_BLOCK;
-        header->next = header->next->next; /* Point to the new next block */
-    }
+#ifdef KHEAP_TLSF
+    TLSF_trim();
+#endif
+}
 
-    /* Check if the previous allocation unit is free */
-    if (temp && temp->free) {
-        temp->size += header->size + ALIGNED_BLOCK;
-        temp->next = header->next;
-        header = temp;
-    }
+/* kfree() releases a block from kmalloc(), kcalloc() or krealloc(). */
 
-    /* If the newly freed space is the last allocation unit, and not the 
-     * head of the list, give the space to the OS */
-    if (!header->next && header != head) {
-        /* Call find header to find the previous block */
-        header = find_header(header, &temp);
+void kfree(void *ptr) {
 
-        /* Adjust size with kbrk() and check for errors */
-        if (kbrk(-(header->size + ALIGNED_BLOCK)) == (void *) -1) {
-            printk("kbrk() error in kfree()\n");
-        }
-        /* The previous block is now the last block and must point to NULL */
-        if (temp) {
-            temp->next = NULL;
-        }
-    }
+    /* Check to see if |ptr| is NULL and silently return if so */
+    if (!ptr)
+        return;
+
+    KPROF_free(ptr);
+    if (is_large(ptr))
+        large_free(ptr);
+    else
+        heap_free(ptr);
 
     if (debug) {
         printk(DEBUG_FREE, ptr);
@@ -248,21 +597,13 @@ void kfree(void *ptr) {
 
 void *kcalloc(size_t nmemb, size_t size) {
     size_t total_size = nmemb * size;
-    void *ret = kmalloc(total_size);
+    void *ret = alloc_block(total_size);
 
-    /* Check if |nmemb| or |size| are zero and return NULL if so */
-    if (!total_size)
-        ret = NULL;
+    KPROF_alloc(ret, total_size, __builtin_return_address(0));
 
-    /* Use memset() to fill the block with zeros and set |ret| to NULL if an
-     * error occurs
-     */
-    if (ret) {
-        if (ret != memset(ret, 0, total_size)) {
-            printk("memset() error");
-            ret = NULL;
-        }
-    }
+    /* Fill the block with zeros, skipping fresh pages that already are */
+    if (ret)
+        MMU_clear_range(ret, total_size);
 
     /* Check to see if the debugging environmental variable is set */
     if (debug) {
@@ -277,12 +618,15 @@ void *kcalloc(size_t nmemb, size_t size) {
 }
 
 void *krealloc(void *ptr, size_t size) {
-    Block *header, *temp, new;
     void *ret;
+    size_t old_size;
 
     /* When |ptr| is NULL, function like malloc */
-    if (!ptr)
-        return kmalloc(size);
+    if (!ptr) {
+        ret = alloc_block(size);
+        KPROF_alloc(ret, size, __builtin_return_address(0));
+        return ret;
+    }
 
     /* When |ptr| is not NULL and |size| is zero, function like free() and
      * return NULL
@@ -292,71 +636,35 @@ void *krealloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    /* Find the allocation unit that contains |ptr| */
-    header = find_header(ptr, NULL);
-    size = align_size(size); /* Make sure |size| is aligned */
+    /* The profiler has to let go of |ptr| before it can be freed */
+    old_size = KPROF_free(ptr);
 
-    /* If a larger size is given, then that allocation unit needs to be
-     * expanded if the next block is free and large enough to hold the new
-     * size, or a new block will be requested from malloc().
+    /* Blocks move between the heap and their own pages as they cross
+     * LARGE_SIZE, and large blocks are resized without copying.
      */
-    if (size > header->size) {
-
-        /* Check if the next block is the perfect size */
-        if (header->next && header->next->free && header->next->size == size - 
-         header->size - ALIGNED_BLOCK) {
-            /* Adjust the pointer to the next block to skip over the block 
-             * that will be assimilated into this one
-             */
-            header->next = header->next->next;
-            header->size = size; /* Adjust the size of this block */
-            ret = ptr;
-        }
-        /* Check if the next block is larger than needed */
-        else if (header->next && header->next->free && header->next->size > 
-         size - header->size) {
-            /* Set up the new allocation unit using |new| to prevent possibly 
-             * overwriting metadata before reading it.
-             */
-            temp = header->next;
-            new.next = temp->next;
-            new.size = temp->size - size + header->size;
-
-            /* New start of the next allocation unit after shrinking */
-            temp = (void *) ((char *) header + size + ALIGNED_BLOCK);
-            temp->next = new.next;
-            temp->size = new.size;
-            temp->free = 1;
-
-            /* Update current allocation unit */
-            header->size = size;
-            header->next = temp;
-            ret = ptr;
-        }
-        /* Otherwise allocate new space */
-        else {
-            ret = kmalloc(size);
-            if (ret) {
-                /* Copy old data to new space */
-                memcpy(ret, (char *) header + ALIGNED_BLOCK, header->size);
-                kfree(ptr);
-            }
+    if (is_large(ptr) && size > LARGE_SIZE)
+        ret = MMU_realloc_pages(ptr, large_pages(size));
+    else if (is_large(ptr)) {
+        ret = heap_malloc(size);
+        if (ret) {
+            memcpy(ret, ptr, size);
+            large_free(ptr);
         }
     }
-    else { /* Smaller size equates to shrinking the block if possible */
-
-        if (size > 0 && size + ALIGNED_BLOCK <= header->size) {
-            /* Create a new block after the current one */
-            temp = (Block *) ((char *) header + size + ALIGNED_BLOCK);
-            temp->next = header->next;
-            temp->free = 1;
-            temp->size = header->size - size - ALIGNED_BLOCK;
-
-            header->size -= size + ALIGNED_BLOCK; /* Shrink size */
-            header->next = temp; /* Make sure new next block is accessible */
+    else if (size > LARGE_SIZE) {
+        ret = MMU_alloc_pages(large_pages(size));
+        if (ret) {
+            memcpy(ret, ptr, heap_size(ptr));
+            heap_free(ptr);
         }
-        ret = ptr;
     }
+    else
+        ret = heap_realloc(ptr, size);
+
+    if (ret)
+        KPROF_alloc(ret, size, __builtin_return_address(0));
+    else if (old_size)
+        KPROF_alloc(ptr, old_size, __builtin_return_address(0));
 
     /* Check to see if the debugging environmental variable is set */
     if (debug) {
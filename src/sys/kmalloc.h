@@ -2,10 +2,24 @@
 #define MALLOC_H
 
 #include <stddef.h>
+#include "../lib/stdint.h"
+
+/* Kernel heap backend, picked at build time with make heap=SLAB|LIST|TLSF. */
+#if !defined(KHEAP_SLAB) && !defined(KHEAP_LIST) && !defined(KHEAP_TLSF)
+#define KHEAP_SLAB
+#endif
+
+#define CACHE_LINE_SIZE 64
+#define LIST_TRIM_KEEP 0xFA00 /* Free bytes the list heap keeps when trimmed. */
 
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void *kcalloc(size_t nmemb, size_t size);
 void *krealloc(void *ptr, size_t _size);
+void *kmalloc_aligned(size_t size, size_t align);
+void *kmalloc_cacheline(size_t size);
+void *dma_alloc(size_t size, uint64_t *phys);
+void dma_free(void *ptr);
+void kmalloc_trim(void);
 
 #endif
@@ -0,0 +1,278 @@
+/**
+ * @file
+ */
+#include "kprof.h"
+#include "cpu.h"
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../drivers/interrupts.h"
+
+#if KPROF
+
+/* Live allocations sit in an open addressing table keyed by pointer, so
+ * kmalloc() and kfree() each add a hash and a short probe. Call sites sit in
+ * a second table keyed by return address that only ever grows.
+ */
+#define LIVE_BITS 13
+#define LIVE_SLOTS (1U << LIVE_BITS)
+#define LIVE_MAX (LIVE_SLOTS / 4 * 3) /* Keeps probes short. */
+#define SITE_BITS 9
+#define SITE_SLOTS (1U << SITE_BITS)
+#define SITE_MAX (SITE_SLOTS / 4 * 3)
+
+/** @brief A live allocation. */
+typedef struct {
+    void *ptr;     /* NULL if the slot is empty. */
+    uint64_t size;
+    uint64_t time; /* rdtsc() when it was allocated. */
+    uint32_t site; /* Index into |sites|. */
+} live_entry;
+
+/** @brief A call site and what KPROF_dump() found out about it. */
+typedef struct {
+    KPROF_site stats;
+    uint64_t old;    /* Live allocations older than the age asked for. */
+    uint64_t oldest; /* rdtsc() of the oldest of them. */
+} site_entry;
+
+static live_entry live[LIVE_SLOTS];
+static site_entry sites[SITE_SLOTS];
+static uint16_t order[SITE_MAX]; /* Sites by live bytes, for KPROF_dump(). */
+static unsigned int num_live, num_sites;
+static uint64_t dropped; /* Allocations that did not fit in |live|. */
+static spinlock_t kprof_lock;
+
+static inline unsigned int hash(void *key, int bits) {
+
+    return ((uint64_t) key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+/** @brief Returns the slot of |ptr| in |live|, or -1. */
+static int find_live(void *ptr) {
+    unsigned int slot;
+
+    for (slot = hash(ptr, LIVE_BITS); live[slot].ptr; 
+     slot = (slot + 1) & (LIVE_SLOTS - 1))
+        if (live[slot].ptr == ptr)
+            return slot;
+
+    return -1;
+}
+
+/** @brief Empties |slot|, moving later entries of its probe run back into
+ * the hole so that lookups never need tombstones.
+ */
+static void remove_live(unsigned int slot) {
+    unsigned int next = (slot + 1) & (LIVE_SLOTS - 1), home;
+
+    while (live[next].ptr) {
+        home = hash(live[next].ptr, LIVE_BITS);
+        /* It may move unless its home lies after the hole. */
+        if (((next - home) & (LIVE_SLOTS - 1)) >= 
+         ((next - slot) & (LIVE_SLOTS - 1))) {
+            live[slot] = live[next];
+            slot = next;
+        }
+        next = (next + 1) & (LIVE_SLOTS - 1);
+    }
+    live[slot].ptr = NULL;
+}
+
+/** @brief Returns the slot of |caller| in |sites|, adding it if |add| is set
+ * and there is room, or -1.
+ */
+static int find_site(void *caller, int add) {
+    unsigned int slot;
+
+    for (slot = hash(caller, SITE_BITS); sites[slot].stats.caller; 
+     slot = (slot + 1) & (SITE_SLOTS - 1))
+        if (sites[slot].stats.caller == caller)
+            return slot;
+
+    if (!add || num_sites == SITE_MAX)
+        return -1;
+    sites[slot].stats.caller = caller;
+    order[num_sites++] = slot;
+
+    return slot;
+}
+
+/** @brief Records that |caller| got |ptr| from an allocation of |size|
+ * bytes.
+ */
+void KPROF_alloc(void *ptr, size_t size, void *caller) {
+    unsigned int slot;
+    int site, ints_enabled = 0;
+
+    if (!ptr)
+        return;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&kprof_lock);
+
+    site = find_site(caller, 1);
+    if (site < 0 || num_live == LIVE_MAX)
+        dropped++;
+    else {
+        for (slot = hash(ptr, LIVE_BITS); live[slot].ptr; 
+         slot = (slot + 1) & (LIVE_SLOTS - 1))
+            ;
+        live[slot].ptr = ptr;
+        live[slot].size = size;
+        live[slot].time = rdtsc();
+        live[slot].site = site;
+        num_live++;
+
+        sites[site].stats.live++;
+        sites[site].stats.live_bytes += size;
+    }
+    if (site >= 0) {
+        sites[site].stats.allocs++;
+        sites[site].stats.bytes += size;
+    }
+
+    spin_unlock(&kprof_lock);
+    if (ints_enabled)
+        STI;
+}
+
+/** @brief Records that |ptr| is about to be freed.
+ *
+ * @returns The size it was allocated with, or 0 if it was not tracked.
+ */
+size_t KPROF_free(void *ptr) {
+    site_entry *site;
+    size_t size = 0;
+    int slot, ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&kprof_lock);
+
+    slot = find_live(ptr);
+    if (slot >= 0) {
+        size = live[slot].size;
+        site = &sites[live[slot].site];
+        site->stats.live--;
+        site->stats.live_bytes -= size;
+        remove_live(slot);
+        num_live--;
+    }
+
+    spin_unlock(&kprof_lock);
+    if (ints_enabled)
+        STI;
+
+    return size;
+}
+
+/** @brief Copies the counters of the call site that allocated |ptr|.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |ptr| is not a tracked live
+ * allocation.
+ */
+int KPROF_ptr_site(void *ptr, KPROF_site *site) {
+    int slot, ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&kprof_lock);
+
+    slot = find_live(ptr);
+    if (slot >= 0)
+        *site = sites[live[slot].site].stats;
+
+    spin_unlock(&kprof_lock);
+    if (ints_enabled)
+        STI;
+
+    return slot >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/** @brief Prints the |top| call sites holding the most live bytes, then the
+ * |top| of those with allocations older than |min_age| cycles, the likely
+ * leaks.
+ *
+ * Allocations wait until it is done.
+ */
+void KPROF_dump(unsigned int top, uint64_t min_age) {
+    site_entry *site;
+    uint64_t now = rdtsc();
+    unsigned int i, j, shown;
+    uint16_t tmp;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&kprof_lock);
+
+    for (i = 0; i < num_sites; i++) {
+        sites[order[i]].old = 0;
+        sites[order[i]].oldest = now;
+    }
+    for (i = 0; i < LIVE_SLOTS; i++) {
+        if (!live[i].ptr || now - live[i].time < min_age)
+            continue;
+        site = &sites[live[i].site];
+        site->old++;
+        if (live[i].time < site->oldest)
+            site->oldest = live[i].time;
+    }
+
+    /* |order| is nearly sorted from the last dump. */
+    for (i = 1; i < num_sites; i++) {
+        tmp = order[i];
+        for (j = i; j && sites[order[j - 1]].stats.live_bytes < 
+         sites[tmp].stats.live_bytes; j--)
+            order[j] = order[j - 1];
+        order[j] = tmp;
+    }
+
+    printk("kprof: %u live allocations tracked, %lu dropped, %u sites\n", 
+     num_live, (unsigned long) dropped, num_sites);
+    for (i = 0; i < num_sites && i < top; i++) {
+        site = &sites[order[i]];
+        printk("%p: %lu live (%lu bytes), %lu allocs (%lu bytes)\n", 
+         site->stats.caller, (unsigned long) site->stats.live, 
+         (unsigned long) site->stats.live_bytes, 
+         (unsigned long) site->stats.allocs, 
+         (unsigned long) site->stats.bytes);
+    }
+
+    printk("kprof: live for over %lu cycles\n", (unsigned long) min_age);
+    for (i = 0, shown = 0; i < num_sites && shown < top; i++) {
+        site = &sites[order[i]];
+        if (!site->old)
+            continue;
+        printk("%p: %lu allocs, oldest %lu cycles\n", site->stats.caller, 
+         (unsigned long) site->old, (unsigned long) (now - site->oldest));
+        shown++;
+    }
+
+    spin_unlock(&kprof_lock);
+    if (ints_enabled)
+        STI;
+}
+
+#else
+
+int KPROF_ptr_site(void *ptr, KPROF_site *site) {
+
+    return EXIT_FAILURE;
+}
+
+void KPROF_dump(unsigned int top, uint64_t min_age) {
+
+    printk("kprof: not built in, make kprof=1\n");
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _KPROF_H
+#define _KPROF_H
+
+#include <stddef.h>
+#include "../lib/stdint.h"
+
+/* Allocation profiler, built in with make kprof=1. */
+#ifndef KPROF
+#define KPROF 0
+#endif
+
+/** @brief Counters of one call site of kmalloc() and friends. */
+typedef struct {
+    void *caller;        /* Return address of the allocation. */
+    uint64_t allocs;     /* Allocations made. */
+    uint64_t bytes;      /* Bytes they asked for. */
+    uint64_t live;       /* Allocations not freed yet. */
+    uint64_t live_bytes; /* Bytes they asked for. */
+} KPROF_site;
+
+#if KPROF
+void KPROF_alloc(void *ptr, size_t size, void *caller);
+size_t KPROF_free(void *ptr);
+#else
+static inline void KPROF_alloc(void *ptr, size_t size, void *caller) {
+}
+
+static inline size_t KPROF_free(void *ptr) {
+
+    return 0;
+}
+#endif
+
+int KPROF_ptr_site(void *ptr, KPROF_site *site);
+void KPROF_dump(unsigned int top, uint64_t min_age);
+
+#endif
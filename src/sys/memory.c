@@ -3,6 +3,12 @@
  */
 #include "memory.h"
 #include "multiboot.h"
+#include "cpu.h"
+#include "tlb.h"
+#include "vmem.h"
+#include "kmalloc.h"
+#include "proc.h"
+#include "acpi.h"
 #include "../lib/stdio.h"
 #include "../lib/stdlib.h"
 #include "../lib/string.h"
@@ -13,397 +19,2069 @@
 #define VIRT_ADDR_MASK 0x1FF /* 9 bits. */
 #define BASE_ADDR_MASK ((1UL << 40) - 1)
 #define ALLOC_ON_DEMAND 1
+#define COPY_ON_WRITE 2 /* Read-only share of a writable page. */
 #define PT_TRAVERSAL_ERROR -1
 #define STACK_ALLIGN 0x10
+#define KSTACK_CACHE_SIZE 8 /* Freed kernel stacks kept mapped for reuse. */
+
+#define CR0_WP (1ULL << 16) /* Ring 0 writes honour read-only pages. */
+
+/* Page fault error code bits. */
+#define PF_ERR_PRESENT 0x1
+#define PF_ERR_WRITE 0x2
+
+#define BOOT_MAP_SIZE 0x40000000ULL /* Identity mapped by boot.asm. */
+#define NUM_RESERVED 3
+#define MAX_RANGES (MB_MAX_REGIONS + NUM_RESERVED)
+
+#define PF_MAG_SIZE 64 /* Frames held by each per-CPU magazine. */
+#define PF_MAG_BATCH 32 /* Frames moved per refill or drain. */
+#define ZERO_POOL_SIZE 256 /* Zeroed frames kept ready. */
+#define ZERO_POOL_BATCH 16 /* Frames zeroed per pass of the zeroing thread. */
+
+#define PT_ENTRIES 512
+#define FAULT_AROUND_PAGES 16 /* Default fault around window (64 KiB). */
 
 #define PT_OFFSET_SHIFT 12
 #define PD_OFFSET_SHIFT (PT_OFFSET_SHIFT + 9)
 #define PDP_OFFSET_SHIFT (PD_OFFSET_SHIFT + 9)
 #define PML4_OFFSET_SHIFT (PDP_OFFSET_SHIFT + 9)
 
+/* PML4 entries [USER_PML4_FIRST, USER_PML4_END) are private to each space. */
+#define USER_PML4_FIRST (USER_ADDR >> PML4_OFFSET_SHIFT)
+#define USER_PML4_END 256 /* The upper canonical half belongs to the kernel. */
+
 /** @brief Pointer to level 4 entry of page table. */
 static PML4 *page_map_l4;
 
-/** @brief Pointer the head of free list. */
-static page_frame *free_list_head;
+/** @brief Added to a physical address to reach it, see phys_to_virt(). */
+uint64_t dmap_offset;
 
-/** @brief Address of next free physical page frame. */
-static uint8_t *phys_blocks;
+/** @brief The address space of the kernel page tables. */
+static MMU_addr_space kernel_as;
 
-/** @brief How physical bytes not in free list are left. */
-static int untracked_bytes_left;
 
-/** @brief Physical low and high memory and kernel locations. */
+/** @brief Frames already zeroed by the zeroing thread. */
+static void *zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_count;
+static MEM_zero_stats zero_stats;
+
+/** @brief Frame metadata, indexed by PFN. Entries are cleared as their chunk
+ * is first carved.
+ */
+static MEM_page *pages;
+
+/** @brief Per order bitmaps. A set bit marks a free block of that order. */
+static uint64_t *free_maps[PF_MAX_ORDER + 1];
+
+/** @brief Number of page frames covered by the buddy bitmaps. */
+static uint64_t max_pfn;
+
+/** @brief Protects the buddy free lists of every zone. */
+static spinlock_t pf_lock;
+
+/** @brief Usable physical memory not yet carved into buddy blocks. */
+struct pf_range {
+    uint64_t next; /* Next address to carve. */
+    uint64_t end;
+};
+
+/** @brief The free memory of one NUMA node. */
+struct pf_zone {
+    uint64_t free_lists[PF_MAX_ORDER + 1]; /* Buddy free list heads. */
+    uint32_t free_order_mask; /* Bit n is set if free_lists[n] is not empty. */
+    uint64_t free_frames;     /* Frames in the free lists. */
+    struct pf_range ranges[MAX_RANGES]; /* Uncarved, in ascending order. */
+    int num_ranges;
+    int cur_range;            /* Lowest range with memory left to carve. */
+    uint64_t uncarved_frames; /* Frames still in |ranges|. */
+    uint64_t present_frames;  /* Usable frames on the node. */
+    MEM_node_stats stats;
+};
+
+/** @brief Page frame zones, indexed by node. */
+static struct pf_zone zones[MEM_MAX_NODES];
+static int num_nodes = 1;
+
+/** @brief Nodes sorted by SLIT distance from each node, itself first. */
+static uint8_t node_order[MEM_MAX_NODES][MEM_MAX_NODES];
+
+/** @brief Node of each CPU, indexed by cpu_id(). */
+static uint8_t cpu_nodes[MAX_CPUS];
+
+/** @brief Node of each max order chunk, whose buddy blocks never cross. */
+static uint8_t *chunk_nodes;
+
+/** @brief Bit n is set once max order chunk n has had its bitmaps cleared. */
+static uint64_t *carved_map;
+
+/** @brief Per-CPU cache of order 0 page frames. */
+struct pf_magazine {
+    unsigned int count;
+    void *frames[PF_MAG_SIZE];
+    MEM_pf_mag_stats stats;
+};
+
+/** @brief Page frame magazines, indexed by cpu_id(). */
+static struct pf_magazine pf_mags[MAX_CPUS];
+
+/** @brief Physical memory map and kernel location. */
 static MB_mem_info mem_info;
 
-/** @brief Tracks next heap address. */
+/** @brief Usable memory that is never handed out: page zero, the kernel image
+ * and the buddy bitmaps.
+ */
+static MB_mem_block reserved[NUM_RESERVED];
+
+/** @brief Pages backed per demand fault, a power of two. */
+static unsigned int fault_around_pages = FAULT_AROUND_PAGES;
+
+/** @brief Demand paging counters. */
+static MEM_fault_stats fault_stats;
+
+/** @brief Kernel heap break. */
 static uint64_t next_virtual_address;
 
-/** @brief Tracks next kernel stack address. */
-static uint64_t next_kernel_stack;
+/** @brief Kernel stack region, handed out in KSTACK_SIZE units. */
+static VMEM_arena kstack_arena;
+
+/** @brief Recently freed kernel stacks, still mapped. */
+static uint64_t kstack_cache[KSTACK_CACHE_SIZE];
+static int kstack_cache_count;
+
+/** @brief Kernel stack cache counters. */
+static MEM_kstack_stats kstack_stats;
+
+/** @brief Kernel page region used by MMU_alloc_pages(). */
+static VMEM_arena kpages_arena;
+
+static inline int block_is_free(uint64_t addr, unsigned int order) {
+    uint64_t index = (addr >> PT_OFFSET_SHIFT) >> order;
+
+    return (free_maps[order][index / 64] >> (index % 64)) & 1;
+}
+
+static inline void set_block_free(uint64_t addr, unsigned int order, 
+ int free) {
+    uint64_t index = (addr >> PT_OFFSET_SHIFT) >> order;
+
+    if (free)
+        free_maps[order][index / 64] |= 1ULL << (index % 64);
+    else
+        free_maps[order][index / 64] &= ~(1ULL << (index % 64));
+}
+
+/** @brief Returns the zone a frame of the buddy allocator belongs to. */
+static inline struct pf_zone *addr_zone(uint64_t addr) {
+
+    return &zones[chunk_nodes[(addr >> PT_OFFSET_SHIFT) >> PF_MAX_ORDER]];
+}
+
+/** @brief Pushes a block onto the free list of its order. */
+static void push_block(struct pf_zone *zone, uint64_t addr, 
+ unsigned int order) {
+    page_frame *block = phys_to_virt(addr);
+
+    block->prev = 0;
+    block->next = zone->free_lists[order];
+    if (block->next)
+        ((page_frame *) phys_to_virt(block->next))->prev = addr;
+    zone->free_lists[order] = addr;
+    zone->free_order_mask |= 1U << order;
+
+    set_block_free(addr, order, 1);
+}
+
+/** @brief Removes a block from anywhere in the free list of its order. */
+static void remove_block(struct pf_zone *zone, uint64_t addr, 
+ unsigned int order) {
+    page_frame *block = phys_to_virt(addr);
+
+    if (block->prev)
+        ((page_frame *) phys_to_virt(block->prev))->next = block->next;
+    else
+        zone->free_lists[order] = block->next;
+
+    if (!zone->free_lists[order])
+        zone->free_order_mask &= ~(1U << order);
+
+    if (block->next)
+        ((page_frame *) phys_to_virt(block->next))->prev = block->prev;
+
+    set_block_free(addr, order, 0);
+}
+
+/** @brief Adds a range of physical memory to the buddy free lists.
+ *
+ * Splits [start, end) into the largest naturally aligned blocks that fit. The
+ * blocks are pushed from the top of the range down so that the lowest 
+ * addresses are handed out first.
+ * @pre The bitmaps covering the range have been cleared.
+ */
+static void add_free_range(struct pf_zone *zone, uint64_t start, 
+ uint64_t end) {
+    uint64_t addr, size;
+    unsigned int order;
+
+    if (start % PAGE_SIZE) /* Round up to PAGE_SIZE. */
+        start += PAGE_SIZE - start % PAGE_SIZE;
+    end -= end % PAGE_SIZE;
+    if (end > max_pfn << PT_OFFSET_SHIFT)
+        end = max_pfn << PT_OFFSET_SHIFT;
+
+    while (end > start) {
+        /* Find the largest block that ends at |end| and is aligned. */
+        for (order = PF_MAX_ORDER; order > 0; order--) {
+            size = (uint64_t) PAGE_SIZE << order;
+            if (end - start >= size && !((end - size) % size))
+                break;
+        }
+
+        size = (uint64_t) PAGE_SIZE << order;
+        addr = end - size;
+        push_block(zone, addr, order);
+        zone->free_frames += 1ULL << order;
+        end = addr;
+    }
+}
+
+/** @brief Appends [start, end) to the uncarved ranges of |zone|.
+ *
+ * Ranges must be added in ascending order. A range that continues the last
+ * one is merged into it.
+ */
+static void add_range(struct pf_zone *zone, uint64_t start, uint64_t end) {
+    int last = zone->num_ranges - 1;
+
+    if (last >= 0 && zone->ranges[last].end == start)
+        zone->ranges[last].end = end;
+    else if (zone->num_ranges < MAX_RANGES) {
+        zone->ranges[zone->num_ranges].next = start;
+        zone->ranges[zone->num_ranges].end = end;
+        zone->num_ranges++;
+    }
+    else
+        return;
+
+    zone->uncarved_frames += (end - start) >> PT_OFFSET_SHIFT;
+    zone->present_frames += (end - start) >> PT_OFFSET_SHIFT;
+}
+
+/** @brief Records a usable region as uncarved, skipping reserved spans.
+ *
+ * Ranges must be added in ascending order. Everything starts out on node 0
+ * until numa_init() has read the SRAT.
+ * @param skip index of the first entry of |reserved| still to be checked.
+ */
+static void add_usable_range(uint64_t start, uint64_t end, int skip) {
+    int i;
+
+    for (i = skip; i < NUM_RESERVED; i++) {
+        if (reserved[i].address < end && 
+         reserved[i].address + reserved[i].size > start) {
+            /* Add the pieces on either side of the reserved span. */
+            if (reserved[i].address > start)
+                add_usable_range(start, reserved[i].address, i + 1);
+            if (reserved[i].address + reserved[i].size < end)
+                add_usable_range(reserved[i].address + reserved[i].size, end, 
+                 i + 1);
+
+            return;
+        }
+    }
+
+    if (start % PAGE_SIZE) /* Round up to PAGE_SIZE. */
+        start += PAGE_SIZE - start % PAGE_SIZE;
+    end -= end % PAGE_SIZE;
+
+    if (end > start)
+        add_range(&zones[0], start, end);
+}
+
+/** @brief Clears the bitmap bits of every order inside a max order chunk. */
+static void clear_chunk_bits(uint64_t chunk) {
+    uint64_t first, bits;
+    unsigned int order;
+
+    for (order = 0; order <= PF_MAX_ORDER; order++) {
+        bits = 1ULL << (PF_MAX_ORDER - order);
+        first = chunk << (PF_MAX_ORDER - order);
+
+        if (bits >= 64)
+            memset(&free_maps[order][first / 64], 0, bits / 8);
+        else
+            free_maps[order][first / 64] &= 
+             ~(((1ULL << bits) - 1) << (first % 64));
+    }
+}
+
+/** @brief Moves the next chunk of uncarved memory to the buddy free lists.
+ *
+ * Carves at most one max order aligned chunk from the lowest range of |zone|
+ * that still has memory left. The bitmaps of a chunk are only cleared the
+ * first time it is carved, so boot never touches memory it does not hand out.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if all memory of |zone| has been
+ * carved.
+ * @pre |pf_lock| is held with interrupts disabled.
+ */
+static int carve_chunk(struct pf_zone *zone) {
+    const uint64_t chunk_size = (uint64_t) PAGE_SIZE << PF_MAX_ORDER;
+    struct pf_range *range;
+    uint64_t start, end, chunk;
+
+    while (zone->cur_range < zone->num_ranges && 
+     zone->ranges[zone->cur_range].next >= zone->ranges[zone->cur_range].end)
+        zone->cur_range++;
+
+    if (zone->cur_range == zone->num_ranges)
+        return EXIT_FAILURE;
+
+    range = &zone->ranges[zone->cur_range];
+    start = range->next;
+    chunk = start / chunk_size;
+    end = (chunk + 1) * chunk_size;
+    if (end > range->end)
+        end = range->end;
+
+    if (!(carved_map[chunk / 64] & (1ULL << (chunk % 64)))) {
+        clear_chunk_bits(chunk);
+        memset(&pages[chunk << PF_MAX_ORDER], 0, 
+         sizeof(MEM_page) << PF_MAX_ORDER);
+        carved_map[chunk / 64] |= 1ULL << (chunk % 64);
+    }
+
+    range->next = end;
+    zone->uncarved_frames -= (end - start) >> PT_OFFSET_SHIFT;
+    add_free_range(zone, start, end);
+
+    return EXIT_SUCCESS;
+}
 
 /** @brief Initializes page frame allocator.
  * 
- * Initializes page frame allocator.
+ * Initializes page frame allocator from every usable region of the multiboot
+ * memory map. Regions are only recorded here and carved into buddy blocks on
+ * demand, so the cost is proportional to the number of regions rather than
+ * the amount of memory.
  * @param mb_tag a pointer to the beginning of the multiboot 2 tags.
  * @pre Multiboot 2 pointer must be valid.
  * @post The page frame allocator is ready to allocate page frames.
  */
 void MMU_pf_init(MB_basic_tag *mb_tag) {
+    int i, ints_enabled = 0;
+    unsigned int order;
+    uint64_t address, end, kern_end, chunks, carved_words, map_size;
+    MB_mem_block *region;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    MB_parse_tags(mb_tag, &mem_info);
+
+    max_pfn = 0;
+    for (i = 0; i < mem_info.num_regions; i++) {
+        region = &mem_info.regions[i];
+        end = region->address + region->size;
+        if (region->type == MULTI_MEM_USABLE && 
+         end >> PT_OFFSET_SHIFT > max_pfn)
+            max_pfn = end >> PT_OFFSET_SHIFT;
+    }
+
+    /* 
+     * Size the page array and bitmaps in whole chunks so carve_chunk() stays 
+     * inside them.
+     */
+    chunks = (max_pfn >> PF_MAX_ORDER) + 1;
+    map_size = (chunks << PF_MAX_ORDER) * sizeof(MEM_page);
+    for (order = 0; order <= PF_MAX_ORDER; order++)
+        map_size += ((chunks << (PF_MAX_ORDER - order)) / 64 + 1) * 
+         sizeof(uint64_t);
+    carved_words = chunks / 64 + 1;
+    map_size += carved_words * sizeof(uint64_t) + chunks;
+
+    /* 
+     * Place the page array and buddy bitmaps in the first usable memory after
+     * the kernel that is covered by the boot identity map.
+     */
+    kern_end = mem_info.kern_start + mem_info.kern_size;
+    address = 0;
+    for (i = 0; i < mem_info.num_regions && !address; i++) {
+        region = &mem_info.regions[i];
+        if (region->type != MULTI_MEM_USABLE)
+            continue;
+
+        address = region->address;
+        if (address < kern_end)
+            address = kern_end;
+        if (address % PAGE_SIZE) /* Round up to PAGE_SIZE. */
+            address += PAGE_SIZE - address % PAGE_SIZE;
+
+        if (address + map_size > region->address + region->size || 
+         address + map_size > BOOT_MAP_SIZE)
+            address = 0;
+    }
+
+    if (!address) /* Nowhere to put the bitmaps. */
+        HALT_CPU
+
+    /* The page array and bitmaps are cleared chunk by chunk when carved. */
+    pages = (MEM_page *) address;
+    address += (chunks << PF_MAX_ORDER) * sizeof(MEM_page);
+    for (order = 0; order <= PF_MAX_ORDER; order++) {
+        free_maps[order] = (uint64_t *) address;
+        address += ((chunks << (PF_MAX_ORDER - order)) / 64 + 1) * 
+         sizeof(uint64_t);
+    }
+    carved_map = (uint64_t *) address;
+    memset(carved_map, 0, carved_words * sizeof(uint64_t));
+    chunk_nodes = (uint8_t *) (carved_map + carved_words);
+    memset(chunk_nodes, 0, chunks);
+    memset(zones, 0, sizeof(zones));
+    num_nodes = 1;
+
+    /* Never hand out page zero so NULL can signal failure. */
+    reserved[0].address = 0;
+    reserved[0].size = PAGE_SIZE;
+    reserved[1].address = mem_info.kern_start;
+    reserved[1].size = mem_info.kern_size;
+    reserved[2].address = (uint64_t) pages;
+    reserved[2].size = map_size;
+
+    /* Record in ascending order so the lowest frames are carved first. */
+    for (i = 0; i < mem_info.num_regions; i++) {
+        region = &mem_info.regions[i];
+        if (region->type == MULTI_MEM_USABLE)
+            add_usable_range(region->address, region->address + region->size, 
+             0);
+    }
+
+    if (ints_enabled)
+        STI;
+}
+
+/** @brief Takes a block of 2^order frames from the free lists of |zone|.
+ *
+ * Takes the smallest free block of at least |order| and splits it, returning
+ * the upper halves to their free lists.
+ * @pre |pf_lock| is held with interrupts disabled.
+ */
+static void *buddy_alloc(struct pf_zone *zone, unsigned int order) {
+    unsigned int cur;
+    uint64_t block;
+
+    /* Find the smallest non-empty free list of at least |order|. */
+    while (!(zone->free_order_mask >> order))
+        if (carve_chunk(zone) == EXIT_FAILURE)
+            return NULL;
+    cur = order + __builtin_ctz(zone->free_order_mask >> order);
+
+    block = zone->free_lists[cur];
+    remove_block(zone, block, cur);
+
+    /* Split until the block is the requested size. */
+    while (cur > order) {
+        cur--;
+        push_block(zone, block + ((uint64_t) PAGE_SIZE << cur), cur);
+    }
+    zone->free_frames -= 1ULL << order;
+
+    return (void *) block;
+}
+
+/** @brief Takes a block of 2^order frames from the nearest node that has one.
+ *
+ * Tries |node| first and then the other nodes by SLIT distance.
+ * @pre |pf_lock| is held with interrupts disabled.
+ */
+static void *node_alloc(int node, unsigned int order) {
+    struct pf_zone *zone;
+    void *ret;
+    int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        zone = &zones[node_order[node][i]];
+        ret = buddy_alloc(zone, order);
+        if (ret) {
+            if (i)
+                zone->stats.remote++;
+            else
+                zone->stats.local++;
+
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Returns a block of 2^order frames to the buddy free lists.
+ *
+ * Merges the block with its buddy for as long as the buddy is also free.
+ * @pre |pf_lock| is held with interrupts disabled.
+ */
+static int buddy_free(uint64_t addr, unsigned int order) {
+    struct pf_zone *zone = addr_zone(addr);
+    uint64_t buddy;
+
+    if (block_is_free(addr, order)) /* Double free. */
+        return EXIT_FAILURE;
+
+    zone->free_frames += 1ULL << order;
+    zone->stats.frees++;
+
+    /* Coalesce with free buddies. */
+    while (order < PF_MAX_ORDER) {
+        buddy = addr ^ ((uint64_t) PAGE_SIZE << order);
+        if ((buddy >> PT_OFFSET_SHIFT) >= max_pfn || 
+         !block_is_free(buddy, order))
+            break;
+
+        remove_block(zone, buddy, order);
+        if (buddy < addr)
+            addr = buddy;
+        order++;
+    }
+    push_block(zone, addr, order);
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Marks the block at |addr| as allocated with one user. */
+static inline void page_alloced(void *addr, unsigned int order) {
+    MEM_page *page = &pages[(uint64_t) addr >> PT_OFFSET_SHIFT];
+
+    page->owner = NULL;
+    page->link = 0;
+    page->refcount = 1;
+    page->flags = PG_HEAD;
+    page->order = order;
+}
+
+/** @brief Marks the block at |addr| as free.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if it is not an allocated block of
+ * |order|.
+ */
+static inline int page_freed(uint64_t addr, unsigned int order) {
+    MEM_page *page = &pages[addr >> PT_OFFSET_SHIFT];
+
+    if (!(page->flags & PG_HEAD) || page->order != order)
+        return EXIT_FAILURE;
+
+    memset(page, 0, sizeof(MEM_page));
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Allocates a block of 2^order physically contiguous page frames.
+ *
+ * Prefers the memory of |node|, falling back to the nearest other node.
+ * @param node the node to allocate from, or -1 for the node of the executing
+ * CPU.
+ * @param order the log2 of the number of page frames to allocate.
+ * @returns The physical address of the block, aligned to its size, or NULL if
+ * no large enough block is free.
+ * @pre MMU_pf_init() has been called.
+ * @post The block is no longer tracked by the free lists.
+ */
+void *MMU_pf_alloc_node(int node, unsigned int order) {
     int ints_enabled = 0;
-    page_frame *ptr;
-    uint64_t address;
+    void *ret;
+
+    if (order > PF_MAX_ORDER || node >= num_nodes)
+        return NULL;
 
     if (are_interrupts_enabled()) {
         ints_enabled = 1;
         CLI;
     }
 
-    mem_info = MB_parse_tags(mb_tag);
-    if (mem_info.low.address == 0)
-        free_list_head = (page_frame *) mem_info.low.address + PAGE_SIZE;
-    else
-        free_list_head = (page_frame *) mem_info.low.address;
+    if (node < 0)
+        node = cpu_nodes[cpu_id()];
+
+    spin_lock(&pf_lock);
+    ret = node_alloc(node, order);
+    spin_unlock(&pf_lock);
+    if (ret)
+        page_alloced(ret, order);
+
+    if (ints_enabled)
+        STI;
+
+    return ret;
+}
+
+/** @brief Allocates a block of 2^order frames near the executing CPU.
+ *
+ * @param order the log2 of the number of page frames to allocate.
+ * @returns The physical address of the block, aligned to its size, or NULL if
+ * no large enough block is free.
+ */
+void *MMU_pf_alloc_order(unsigned int order) {
+
+    return MMU_pf_alloc_node(-1, order);
+}
+
+/** @brief Frees a block of 2^order page frames.
+ *
+ * @param pf a pointer to the first page frame of the block.
+ * @param order the order the block was allocated with.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |pf| is not a valid allocated
+ * block.
+ * @pre The block was returned by MMU_pf_alloc_order() with the same order.
+ * @post The block, possibly merged, is on a free list.
+ */
+int MMU_pf_free_order(void *pf, unsigned int order) {
+    uint64_t addr = (uint64_t) pf;
+    int ret, ints_enabled = 0;
+
+    if (!pf || order > PF_MAX_ORDER || addr % ((uint64_t) PAGE_SIZE << order) 
+     || (addr >> PT_OFFSET_SHIFT) >= max_pfn)
+        return EXIT_FAILURE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    ret = page_freed(addr, order);
+    if (ret == EXIT_SUCCESS) {
+        spin_lock(&pf_lock);
+        ret = buddy_free(addr, order);
+        spin_unlock(&pf_lock);
+    }
+
+    if (ints_enabled)
+        STI;
+
+    return ret;
+}
+
+/** @brief Returns the number of free page frames, including cached ones. */
+uint64_t MMU_pf_free_count(void) {
+    uint64_t count = 0;
+    unsigned int cpu;
+    int node;
+
+    for (node = 0; node < num_nodes; node++)
+        count += zones[node].free_frames + zones[node].uncarved_frames;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        count += pf_mags[cpu].count;
+
+    return count + zero_pool_count;
+}
+
+/** @brief Returns the number of NUMA nodes, 1 without an SRAT. */
+int MMU_num_nodes(void) {
+
+    return num_nodes;
+}
+
+/** @brief Returns the node the frame at |pf| belongs to, or -1. */
+int MMU_pf_node(void *pf) {
+
+    if ((uint64_t) pf >> PT_OFFSET_SHIFT >= max_pfn)
+        return -1;
+
+    return chunk_nodes[((uint64_t) pf >> PT_OFFSET_SHIFT) >> PF_MAX_ORDER];
+}
+
+/** @brief Copies the counters of |node| into |stats|.
+ *
+ * Frames cached in the per-CPU magazines and the zero pool count as used.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if there is no such node.
+ */
+int MMU_node_stats(int node, MEM_node_stats *stats) {
+    struct pf_zone *zone;
+
+    if (node < 0 || node >= num_nodes)
+        return EXIT_FAILURE;
+
+    zone = &zones[node];
+    memcpy(stats, &zone->stats, sizeof(MEM_node_stats));
+    stats->present = zone->present_frames;
+    stats->free = zone->free_frames + zone->uncarved_frames;
+    stats->used = stats->present - stats->free;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Copies the page frame magazine counters of |cpu| into |stats|. */
+void MMU_pf_mag_stats(unsigned int cpu, MEM_pf_mag_stats *stats) {
+
+    if (cpu < MAX_CPUS)
+        memcpy(stats, &pf_mags[cpu].stats, sizeof(MEM_pf_mag_stats));
+}
+
+/** @brief Allocates a page frame.
+ *
+ * Pops a frame from the magazine of the executing CPU. An empty magazine is
+ * refilled with PF_MAG_BATCH frames from the buddy allocator first, so the
+ * global lock is only taken once per batch. Refills come from the node of the
+ * CPU while it has memory.
+ * @returns A pointer to the start of a page frame or NULL if no more free
+ * pages exist.
+ * @pre Multiboot 2 type 6 (memory) and 9 (ELF sections) tags have been parsed 
+ * and information stored in the global MB_mem_info struct.
+ * @post A free page frame has been allocated and tracked.
+ */
+void *MMU_pf_alloc(void) {
+    struct pf_magazine *mag;
+    void *ret = NULL, *frame;
+    unsigned int cpu;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    cpu = cpu_id();
+    mag = &pf_mags[cpu];
+    if (mag->count)
+        mag->stats.hits++;
+    else { /* Refill from the global pool. */
+        mag->stats.misses++;
+        mag->stats.refills++;
+
+        spin_lock(&pf_lock);
+        while (mag->count < PF_MAG_BATCH && 
+         (frame = node_alloc(cpu_nodes[cpu], 0)))
+            mag->frames[mag->count++] = frame;
+        spin_unlock(&pf_lock);
+    }
+
+    if (mag->count) {
+        ret = mag->frames[--mag->count];
+        page_alloced(ret, 0);
+    }
+    else if (zero_pool_count) /* Rather than fail, use a zeroed frame. */
+        ret = zero_pool[--zero_pool_count];
+
+    if (ints_enabled)
+        STI;
+
+    return ret;
+}
+
+/** @brief Frees a page frame.
+ *
+ * Pushes the frame onto the magazine of the executing CPU. A full magazine
+ * drains PF_MAG_BATCH frames back to the buddy allocator first.
+ *
+ * @param pf a pointer to the page frame to be freed.
+ * @pre A page frame has been allocated.
+ * @post pf is added to the free pool.
+ */
+int MMU_pf_free(void *pf) {
+    struct pf_magazine *mag;
+    uint64_t addr = (uint64_t) pf;
+    int ints_enabled = 0;
+
+    /* Must be a non-NULL pointer that is 4K aligned. */
+    if (!pf || addr % PAGE_SIZE || (addr >> PT_OFFSET_SHIFT) >= max_pfn)
+        return EXIT_FAILURE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    if (page_freed(addr, 0) != EXIT_SUCCESS) { /* Double or partial free. */
+        if (ints_enabled)
+            STI;
+
+        return EXIT_FAILURE;
+    }
+
+    mag = &pf_mags[cpu_id()];
+    if (mag->count == PF_MAG_SIZE) { /* Drain to the global pool. */
+        mag->stats.drains++;
+
+        spin_lock(&pf_lock);
+        while (mag->count > PF_MAG_SIZE - PF_MAG_BATCH)
+            buddy_free((uint64_t) mag->frames[--mag->count], 0);
+        spin_unlock(&pf_lock);
+    }
+    mag->frames[mag->count++] = pf;
+
+    if (ints_enabled)
+        STI;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Zeroes a frame with non-temporal stores.
+ *
+ * The stores bypass the cache, so zeroing frames ahead of time does not evict
+ * the working set of other threads.
+ */
+static void zero_frame_nt(void *frame) {
+    uint64_t *word = frame, *end = word + PAGE_SIZE / sizeof(uint64_t);
+
+    for (; word < end; word += 4)
+        asm volatile ( "movnti %1, (%0)\n\t"
+                       "movnti %1, 8(%0)\n\t"
+                       "movnti %1, 16(%0)\n\t"
+                       "movnti %1, 24(%0)"
+         : : "r"(word), "r"(0ULL) : "memory" );
+
+    asm volatile ( "sfence" : : : "memory" );
+}
+
+/** @brief Allocates a page frame filled with zeros.
+ *
+ * Takes a frame from the pool kept by MMU_zero_thread(), only zeroing one on
+ * the spot when the pool is empty. The frame is marked PG_ZERO.
+ * @returns A pointer to the frame, or NULL if no free frames exist.
+ */
+void *MMU_pf_alloc_zeroed(void) {
+    void *ret = NULL;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    if (zero_pool_count) {
+        ret = zero_pool[--zero_pool_count];
+        zero_stats.hits++;
+    }
+    else
+        zero_stats.misses++;
+
+    if (ints_enabled)
+        STI;
+
+    if (!ret) {
+        ret = MMU_pf_alloc();
+        if (!ret)
+            return NULL;
+
+        memset(phys_to_virt((uint64_t) ret), 0, PAGE_SIZE);
+        pages[(uint64_t) ret >> PT_OFFSET_SHIFT].flags |= PG_ZERO;
+    }
+
+    return ret;
+}
+
+/** @brief Zeroes frames into the zero pool.
+ *
+ * @param max the most frames to zero.
+ * @returns The number of frames added.
+ */
+int MMU_zero_pool_fill(unsigned int max) {
+    void *frame;
+    int added = 0, ints_enabled;
+
+    while (max-- && zero_pool_count < ZERO_POOL_SIZE) {
+        frame = MMU_pf_alloc();
+        if (!frame)
+            break;
+
+        /* Zero with interrupts on, only the push has to be atomic. */
+        zero_frame_nt(phys_to_virt((uint64_t) frame));
+        pages[(uint64_t) frame >> PT_OFFSET_SHIFT].flags |= PG_ZERO;
+
+        ints_enabled = 0;
+        if (are_interrupts_enabled()) {
+            ints_enabled = 1;
+            CLI;
+        }
+
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_count++] = frame;
+            zero_stats.zeroed++;
+            added++;
+        }
+        else
+            MMU_pf_free(frame);
+
+        if (ints_enabled)
+            STI;
+    }
+
+    return added;
+}
+
+/** @brief Kernel thread that keeps the zero pool topped up.
+ *
+ * Zeroes ZERO_POOL_BATCH frames between yields so other threads are not held
+ * up. Once the pool is full it gives free heap memory back with
+ * kmalloc_trim(), which must not run in interrupt context, and halts until
+ * the next interrupt.
+ */
+void MMU_zero_thread(void *arg) {
+
+    for (;;) {
+        if (!MMU_zero_pool_fill(ZERO_POOL_BATCH)) {
+            kmalloc_trim();
+            HALT_CPU
+        }
+        yield();
+    }
+}
+
+/** @brief Copies the zero pool counters into |stats|. */
+void MMU_zero_stats(MEM_zero_stats *stats) {
+
+    memcpy(stats, &zero_stats, sizeof(MEM_zero_stats));
+    stats->pooled = zero_pool_count;
+}
+
+/** @brief Returns the metadata of the frame at |pf|, or NULL if out of range.
+ */
+MEM_page *MMU_pf_to_page(void *pf) {
+    uint64_t pfn = (uint64_t) pf >> PT_OFFSET_SHIFT;
+
+    return pfn < max_pfn ? &pages[pfn] : NULL;
+}
+
+/** @brief Returns the physical address of the frame described by |page|. */
+void *MMU_page_to_pf(MEM_page *page) {
+
+    return (void *) ((uint64_t) (page - pages) << PT_OFFSET_SHIFT);
+}
+
+/** @brief Takes another reference to the allocated frame at |pf|.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |pf| is not allocated or its 
+ * count is saturated.
+ */
+int MMU_pf_get(void *pf) {
+    MEM_page *page = MMU_pf_to_page(pf);
+
+    if (!page || !page->refcount || page->refcount == UINT16_MAX)
+        return EXIT_FAILURE;
+
+    __sync_fetch_and_add(&page->refcount, 1);
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Drops a reference to the frame at |pf|, freeing it with the last.
+ */
+int MMU_pf_put(void *pf) {
+    MEM_page *page = MMU_pf_to_page(pf);
+
+    if (!page || !page->refcount)
+        return EXIT_FAILURE;
+
+    if (__sync_sub_and_fetch(&page->refcount, 1))
+        return EXIT_SUCCESS;
+
+    return MMU_pf_free(pf);
+}
+
+/** @brief Returns the table a present PML4, PDP or PD entry points to. */
+static inline void *entry_table(PDP *entry) {
+
+    return phys_to_virt((uint64_t) entry->base_addr << PT_OFFSET_SHIFT);
+}
+
+/** @brief Returns the table an entry points to, creating it if needed.
+ *
+ * Works for PML4, PDP and PD entries since they share the same layout.
+ */
+static void *next_table(PDP *entry) {
+    void *table;
+
+    if (entry->present)
+        return entry_table(entry);
+
+    table = MMU_pf_alloc_zeroed();
+    if (!table) {
+        printk("MMU_pf_alloc failed to alloc a page table\n");
+        HALT_CPU
+    }
+
+    entry->base_addr = (uint64_t) table >> PT_OFFSET_SHIFT;
+    entry->present = 1;
+    entry->r_w = 1;
+
+    return phys_to_virt((uint64_t) table);
+}
+
+/** @brief Walks the page table.
+ *
+ * @returns The index of |addr| in the level 1 table stored in |pt|, or
+ * PT_TRAVERSAL_ERROR if |addr| is mapped by a large page.
+ * @pre PML4 must exist.
+ * @post Any missing tables on the way to |addr| have been created.
+ */
+static int walk_page_table(uint64_t addr, PML4 *pml4, PT **pt) {
+    uint64_t index;
+    int ints_enabled = 0;
+    PDP *pdp;
+    PD *pd;
+
+    if (!pml4)
+        return -1;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    index = (addr >> PML4_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+    pdp = next_table((PDP *) &pml4[index]); /* Create PDP if not present. */
+
+    index = (addr >> PDP_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+    if (pdp[index].ps) { /* Part of a 1 GiB page. */
+        if (ints_enabled)
+            STI;
+
+        return PT_TRAVERSAL_ERROR;
+    }
+    pd = next_table(&pdp[index]); /* Create PD if not present. */
+
+    index = (addr >> PD_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+    if (pd[index].ps) { /* Part of a 2 MiB page. */
+        if (ints_enabled)
+            STI;
+
+        return PT_TRAVERSAL_ERROR;
+    }
+    *pt = next_table(&pd[index]); /* Create page table if not present. */
+
+    if (ints_enabled)
+        STI;
+
+    return (addr >> PT_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+}
+
+/** @brief Makes a PDP or PD entry map a large page at |addr|. */
+static void set_large_page(PDP *entry, uint64_t addr) {
+
+    entry->base_addr = addr >> PT_OFFSET_SHIFT;
+    entry->ps = 1;
+    entry->global_page = 1;
+    entry->r_w = 1;
+    entry->present = 1;
+}
+
+/** @brief Maps physical memory [start, end) at |base| + address.
+ *
+ * Uses 1 GiB pages where CPUID reports pdpe1gb support and 2 MiB pages
+ * otherwise.
+ * @pre |start| is 2 MiB aligned and |base| is 1 GiB aligned.
+ */
+static void map_large(PML4 *pml4, uint64_t base, uint64_t start,
+ uint64_t end) {
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t addr, virt;
+    int index, gb_pages;
+    PDP *pdp;
+    PD *pd;
+
+    cpuid(CPUID_EXT_FEATURES, &eax, &ebx, &ecx, &edx);
+    gb_pages = (edx & CPUID_EXT_PDPE1GB) != 0;
+
+    /* Round up so the last large page covers the end of memory. */
+    if (end % PAGE_SIZE_2M)
+        end += PAGE_SIZE_2M - end % PAGE_SIZE_2M;
+
+    for (addr = start; addr < end; ) {
+        virt = base + addr;
+        index = (virt >> PML4_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+        pdp = next_table((PDP *) &pml4[index]);
+
+        index = (virt >> PDP_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+        if (gb_pages && !(addr % PAGE_SIZE_1G) && end - addr >= PAGE_SIZE_1G) {
+            set_large_page(&pdp[index], addr);
+            addr += PAGE_SIZE_1G;
+            continue;
+        }
+        pd = next_table(&pdp[index]);
+
+        index = (virt >> PD_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+        set_large_page(&pd[index], addr);
+        addr += PAGE_SIZE_2M;
+    }
+}
+
+/** @brief Identity maps the low memory the kernel image lives in.
+ *
+ * The first 2 MiB are mapped with 4 KiB pages so that page zero can be
+ * handled separately. Everything else reaches physical memory through the
+ * direct map.
+ * @param size bytes of low memory to map.
+ */
+static void identity_map(PML4 *pml4, uint64_t size) {
+    uint64_t addr;
+    int index;
+    PT *pt;
+
+    for (addr = 0; addr < PAGE_SIZE_2M; addr += PAGE_SIZE) {
+        index = walk_page_table(addr, pml4, &pt);
+        pt[index].present = 1;
+        pt[index].r_w = 1;
+        pt[index].global_page = 1;
+
+        if (addr) /* Set current address to be the actual page referenced. */
+            pt[index].base_addr = addr >> PT_OFFSET_SHIFT;
+        else /* Do not map address zero. */
+            pt[index].base_addr = (uint64_t) MMU_pf_alloc() >> PT_OFFSET_SHIFT;
+    }
+
+    map_large(pml4, 0, PAGE_SIZE_2M, size);
+}
+
+/** @brief Switches phys_to_virt() over to the direct map.
+ *
+ * Pointers into physical memory made while it still used the boot identity
+ * map are moved to the direct map as well.
+ * @pre The page tables with the direct map are loaded.
+ */
+static void enable_direct_map(void) {
+    unsigned int order;
+
+    dmap_offset = DMAP_ADDR;
+
+    page_map_l4 = phys_to_virt((uint64_t) page_map_l4);
+    pages = phys_to_virt((uint64_t) pages);
+    carved_map = phys_to_virt((uint64_t) carved_map);
+    chunk_nodes = phys_to_virt((uint64_t) chunk_nodes);
+    for (order = 0; order <= PF_MAX_ORDER; order++)
+        free_maps[order] = phys_to_virt((uint64_t) free_maps[order]);
+}
+
+/** @brief Returns the node the SRAT puts physical address |addr| on. */
+static int srat_node(ACPI_numa_info *info, uint64_t addr) {
+    int i;
+
+    for (i = 0; i < info->num_mem; i++)
+        if (addr >= info->mem[i].base && 
+         addr - info->mem[i].base < info->mem[i].length)
+            return info->mem[i].node < num_nodes ? info->mem[i].node : 0;
+
+    return 0;
+}
+
+/** @brief Splits the page frame allocator into one zone per NUMA node.
+ *
+ * Memory that is still uncarved moves to the zone of its node a chunk at a
+ * time, by the node of the first frame in the chunk. Chunks already carved
+ * stay on node 0. Without an SRAT everything stays in a single zone.
+ * @pre phys_to_virt() reaches the ACPI tables and interrupts are disabled.
+ */
+static void numa_init(void) {
+    static ACPI_numa_info info;
+    static struct pf_range old[MAX_RANGES];
+    const uint64_t chunk_size = (uint64_t) PAGE_SIZE << PF_MAX_ORDER;
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t start, end, chunk, last_chunk = ~0ULL;
+    int i, j, k, node, num_old = 0;
+
+    if (ACPI_parse_numa(mem_info.rsdp, mem_info.rsdp_size, &info) != 
+     EXIT_SUCCESS)
+        return;
+
+    num_nodes = info.num_nodes < MEM_MAX_NODES ? info.num_nodes : 
+     MEM_MAX_NODES;
+
+    /* Sort the other nodes of each node by distance, ties by number. */
+    for (i = 0; i < num_nodes; i++) {
+        node_order[i][0] = i;
+        for (j = 0, k = 1; j < num_nodes; j++) {
+            if (j == i)
+                continue;
+
+            for (node = k++; node > 1 && 
+             info.distance[i][node_order[i][node - 1]] > info.distance[i][j]; 
+             node--)
+                node_order[i][node] = node_order[i][node - 1];
+            node_order[i][node] = j;
+        }
+    }
+
+    /* Only the bootstrap processor runs, find it by its initial APIC ID. */
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    for (i = 0; i < info.num_cpus; i++)
+        if (info.apic_ids[i] == ebx >> 24 && info.cpu_nodes[i] < num_nodes)
+            cpu_nodes[0] = info.cpu_nodes[i];
+
+    /* Take back the uncarved memory of zone 0 and hand it out by node. */
+    for (i = zones[0].cur_range; i < zones[0].num_ranges; i++)
+        if (zones[0].ranges[i].next < zones[0].ranges[i].end)
+            old[num_old++] = zones[0].ranges[i];
+    zones[0].num_ranges = zones[0].cur_range = 0;
+    zones[0].present_frames -= zones[0].uncarved_frames;
+    zones[0].uncarved_frames = 0;
+
+    for (i = 0; i < num_old; i++) {
+        for (start = old[i].next; start < old[i].end; start = end) {
+            chunk = start / chunk_size;
+            end = (chunk + 1) * chunk_size;
+            if (end > old[i].end)
+                end = old[i].end;
+
+            /* All of a chunk must be on one node for its buddies to merge. */
+            if (chunk != last_chunk && 
+             !(carved_map[chunk / 64] & (1ULL << (chunk % 64))))
+                chunk_nodes[chunk] = srat_node(&info, start);
+            last_chunk = chunk;
+
+            add_range(&zones[chunk_nodes[chunk]], start, end);
+        }
+    }
+}
+
+/** @brief Initializes virtual memory management.
+ *
+ * @post The virtual memory manager is initialized.
+ */
+int MMU_init() {
+    int i, ints_enabled = 0;
+    uint64_t phys_mem_size = max_pfn << PT_OFFSET_SHIFT, end;
+    MB_mem_block *region;
+    CR3 cr3;
+
+    /* 
+     * Need to:
+     *  - Create at least one PDPT per region. 
+     *  - Install the same PML4E entry in every address space.
+     *  - Updates to PDPE or lower levels does not require changing any
+     *    PML4 tables.
+     *  - Cross-compiler will place user space programs at address 0x10000
+     *    (where the kernel is located).
+     */
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    /* Create level 4 page map. */
+    page_map_l4 = MMU_pf_alloc_zeroed();
+    if (!page_map_l4) {
+        printk("MMU_pf_alloc error allocating PML4\n");
+        HALT_CPU
+    }
+
+    /* Create at least one PDPT per region. */
+
+    /* The ACPI tables can lie past the last usable frame. */
+    for (i = 0; i < mem_info.num_regions; i++) {
+        region = &mem_info.regions[i];
+        end = region->address + region->size;
+        if ((region->type == MULTI_MEM_ACPI || region->type == MULTI_MEM_NVS) 
+         && end > phys_mem_size)
+            phys_mem_size = end;
+    }
+
+    /* Identity map the kernel image and direct map all of memory. */
+    identity_map(page_map_l4, BOOT_MAP_SIZE);
+    map_large(page_map_l4, DMAP_ADDR, 0, phys_mem_size);
+
+    /* Kernel stacks. */
+    VMEM_init(&kstack_arena, "kstacks", KSTACKS_ADDR, 
+     KRESERVED_ADDR - KSTACKS_ADDR, KSTACK_SIZE);
+
+    /* Growth region. */
+
+    /* Kernel heaps. */
+    next_virtual_address = KHEAP_ADDR; /* Set first kernel heap address. */
+    VMEM_init(&kpages_arena, "kpages", KPAGES_ADDR, USER_ADDR - KPAGES_ADDR, 
+     PAGE_SIZE);
+
+
+    /* 
+     * Create every kernel PDPT now so that the kernel PML4 entries never 
+     * change and can be copied into each new address space.
+     */
+    for (i = 0; i < PT_ENTRIES; i++)
+        if (i < USER_PML4_FIRST || i >= USER_PML4_END)
+            next_table((PDP *) &page_map_l4[i]);
+
+    /* User space. */
+
+    /* Set CR3 last. */
+    cr3.base_addr = virt_to_phys(page_map_l4) >> PT_OFFSET_SHIFT;
+    cr3.reserved1 = 0;
+    cr3.pwt = 0;
+    cr3.pcd = 0;
+    cr3.reserved2 = 0;
+    cr3.reserved3 = 0;
+    __asm__("movq %0, %%cr3" : : "r"(cr3));
+    TLB_init(); /* Enable global pages and PCIDs. */
+    enable_direct_map();
+    numa_init();
+
+    kernel_as.pml4 = page_map_l4;
+    kernel_as.pcid = KERNEL_PCID;
+    kernel_as.cr3 = TLB_make_cr3(virt_to_phys(page_map_l4), KERNEL_PCID, 1);
+    kernel_as.refcount = 1;
+
+    /* Make copy-on-write pages read-only for the kernel as well. */
+    write_cr0(read_cr0() | CR0_WP);
+
+    /* Set IRQ handler. */
+    IRQ_set_handler(PAGE_FAULT, MMU_page_fault_handler, NULL);
+
+    if (ints_enabled)
+        STI;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief State shared by one walk of a virtual address range. */
+struct range_walk {
+    int create; /* Create missing tables instead of skipping them. */
+    int flags;  /* MMU_MAP_* flags. */
+    TLB_gather gather; /* Pages whose translations must be invalidated. */
+    uint64_t delta;    /* move_pte(): distance to the destination entry. */
+    int error;         /* Set when part of the range could not be handled. */
+    void (*pte_fn)(PT *pte, uint64_t addr, struct range_walk *walk);
+};
+
+/** @brief Walks the entries of |table| that cover [addr, end).
+ *
+ * Descends into a lower level table once per table rather than once per page,
+ * and calls |walk->pte_fn| for each level 1 entry in the range. Ranges covered
+ * by large pages are skipped, as are missing tables unless |walk->create| is
+ * set. Skipping a large page while creating sets |walk->error|.
+ * @param shift the address bit that indexes |table|.
+ * @pre Interrupts are disabled.
+ */
+static void walk_range(PDP *table, int shift, uint64_t addr, uint64_t end, 
+ struct range_walk *walk) {
+    const uint64_t span = 1ULL << shift;
+    uint64_t next;
+    PDP *entry;
+
+    for (; addr < end; addr = next) {
+        next = (addr & ~(span - 1)) + span;
+        if (next > end || !next)
+            next = end;
+
+        entry = &table[(addr >> shift) & VIRT_ADDR_MASK];
+        if (shift == PT_OFFSET_SHIFT)
+            walk->pte_fn((PT *) entry, addr, walk);
+        else if (entry->ps || (!entry->present && !walk->create)) {
+            if (entry->ps && walk->create)
+                walk->error = 1;
+        }
+        else {
+            if (walk->flags & MMU_MAP_USER)
+                entry->u_s = 1;
+            walk_range(next_table(entry), shift - 9, addr, next, walk);
+        }
+    }
+}
+
+/** @brief Backs an on demand level 1 entry with a frame.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if no frame is available.
+ */
+static int back_pte(PT *pte) {
+    void *frame = MMU_pf_alloc_zeroed();
+
+    if (!frame)
+        return EXIT_FAILURE;
+
+    pte->base_addr = (uint64_t) frame >> PT_OFFSET_SHIFT;
+    pte->present = 1;
+    pte->avl &= ~ALLOC_ON_DEMAND;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Marks a level 1 entry for allocation on first touch.
+ *
+ * With MMU_MAP_POPULATE the entry is backed right away instead, falling back
+ * to allocation on demand if no frame is free.
+ */
+static void map_pte(PT *pte, uint64_t addr, struct range_walk *walk) {
+
+    pte->present = 0; /* Will mark present after handler allocs page. */
+    pte->avl = ALLOC_ON_DEMAND; /* Set on demand allocation bit. */
+    pte->r_w = (walk->flags & MMU_MAP_WRITE) != 0;
+    pte->u_s = (walk->flags & MMU_MAP_USER) != 0;
+    pte->nx = (walk->flags & MMU_MAP_NX) != 0;
+    pte->global_page = !pte->u_s; /* Kernel mappings are in every space. */
+
+    if (walk->flags & MMU_MAP_POPULATE && back_pte(pte) == EXIT_SUCCESS)
+        fault_stats.populated++;
+}
+
+/** @brief Clears a level 1 entry, freeing its frame if one was allocated. */
+static void unmap_pte(PT *pte, uint64_t addr, struct range_walk *walk) {
+
+    if (pte->present) {
+        MMU_pf_put((void *) ((uint64_t) pte->base_addr << PT_OFFSET_SHIFT));
+        TLB_gather_add(&walk->gather, (void *) addr);
+    }
+
+    pte->present = 0;
+    pte->avl &= ~(ALLOC_ON_DEMAND | COPY_ON_WRITE);
+    pte->base_addr = 0;
+}
+
+/** @brief Moves a level 1 entry |walk->delta| bytes further on, leaving the
+ * source cleared.
+ *
+ * The frame moves with the entry, so the page keeps its contents. If the
+ * destination has no level 1 table the source stays and |walk->error| is set.
+ */
+static void move_pte(PT *pte, uint64_t addr, struct range_walk *walk) {
+    PT *dst;
+    int index;
+
+    if (!pte->present && !(pte->avl & ALLOC_ON_DEMAND))
+        return;
+
+    index = walk_page_table(addr + walk->delta, page_map_l4, &dst);
+    if (index == PT_TRAVERSAL_ERROR) {
+        walk->error = 1;
+        return;
+    }
+    dst[index] = *pte;
+
+    if (pte->present)
+        TLB_gather_add(&walk->gather, (void *) addr);
+    pte->present = 0;
+    pte->avl &= ~(ALLOC_ON_DEMAND | COPY_ON_WRITE);
+    pte->base_addr = 0;
+}
+
+/** @brief Changes the protection of a mapped level 1 entry. */
+static void protect_pte(PT *pte, uint64_t addr, struct range_walk *walk) {
+
+    if (!pte->present && !(pte->avl & ALLOC_ON_DEMAND))
+        return;
+
+    /* Shared frames stay read-only until the write fault copies them, also
+     * after a read-only protect or clone dropped the COW bit.
+     */
+    if (!(walk->flags & MMU_MAP_WRITE))
+        pte->avl &= ~COPY_ON_WRITE;
+    else if (pte->present && pages[pte->base_addr].refcount > 1)
+        pte->avl |= COPY_ON_WRITE;
+    pte->r_w = walk->flags & MMU_MAP_WRITE && !(pte->avl & COPY_ON_WRITE);
+    pte->u_s = (walk->flags & MMU_MAP_USER) != 0;
+    pte->nx = (walk->flags & MMU_MAP_NX) != 0;
+
+    if (pte->present)
+        TLB_gather_add(&walk->gather, (void *) addr);
+}
+
+/** @brief Returns whether the page tables of |as| are loaded. */
+static inline int addr_space_loaded(MMU_addr_space *as) {
+
+    return (read_cr3() & ~CR3_NOFLUSH) == (as->cr3 & ~CR3_NOFLUSH);
+}
+
+/** @brief Drops the non-global TLB entries of |as|.
+ *
+ * invlpg and plain CR3 loads only reach the current PCID, so the entries of
+ * another space are dropped by loading it once without NOFLUSH.
+ * @pre Interrupts are disabled.
+ */
+static void flush_addr_space(MMU_addr_space *as) {
+    uint64_t cr3 = read_cr3();
+
+    if (addr_space_loaded(as))
+        write_cr3(as->cr3 & ~CR3_NOFLUSH);
+    else if (TLB_pcid_enabled()) {
+        write_cr3(as->cr3 & ~CR3_NOFLUSH);
+        write_cr3(cr3 | CR3_NOFLUSH);
+    }
+}
+
+/** @brief Runs |walk| over [addr, addr + size) of the page tables of |as|.
+ *
+ * Invalidates the translations the walk changed in one batch at the end.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if the walk set |walk->error|.
+ */
+static int run_range_walk(MMU_addr_space *as, void *addr, uint64_t size, 
+ struct range_walk *walk) {
+    uint64_t start = (uint64_t) addr, end = (uint64_t) addr + size;
+    int ints_enabled = 0;
+
+    start -= start % PAGE_SIZE;
+    if (end % PAGE_SIZE) /* Round up to PAGE_SIZE. */
+        end += PAGE_SIZE - end % PAGE_SIZE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    TLB_gather_init(&walk->gather);
+    walk->error = 0;
+    walk_range((PDP *) as->pml4, PML4_OFFSET_SHIFT, start, end, walk);
+
+    /* Kernel entries are global, so invlpg reaches them from any space. */
+    if ((walk->gather.count || walk->gather.flush_all) && as != &kernel_as && 
+     !addr_space_loaded(as))
+        flush_addr_space(as);
+    else
+        TLB_gather_flush(&walk->gather);
+
+    if (ints_enabled)
+        STI;
+
+    return walk->error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/** @brief Maps a virtual range for allocation on demand.
+ *
+ * @param addr start of the range, rounded down to a page.
+ * @param size length of the range in bytes, rounded up to whole pages.
+ * @param flags MMU_MAP_* flags for the new mappings.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if part of the range lies in a large
+ * page and was left alone.
+ * @post Every page of the range is backed by a frame on first touch.
+ */
+int MMU_map_range(void *addr, uint64_t size, int flags) {
+    struct range_walk walk;
+
+    walk.create = 1;
+    walk.flags = flags;
+    walk.pte_fn = map_pte;
+
+    return run_range_walk(&kernel_as, addr, size, &walk);
+}
+
+/** @brief Unmaps a virtual range and frees the frames backing it.
+ *
+ * @param addr start of the range, rounded down to a page.
+ * @param size length of the range in bytes, rounded up to whole pages.
+ * @returns EXIT_SUCCESS.
+ */
+int MMU_unmap_range(void *addr, uint64_t size) {
+    struct range_walk walk;
+
+    walk.create = 0;
+    walk.flags = 0;
+    walk.pte_fn = unmap_pte;
+    run_range_walk(&kernel_as, addr, size, &walk);
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Moves the mappings of a kernel range to another range.
+ *
+ * Pages keep their frames, so this relocates data without copying it.
+ * @param from start of the range, rounded down to a page.
+ * @param to where the range moves to, page aligned and not mapped.
+ * @param size length of the range in bytes, rounded up to whole pages.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if some entries could not be moved.
+ * Those stay in the source range, the rest have moved.
+ */
+int MMU_move_range(void *from, void *to, uint64_t size) {
+    struct range_walk walk;
+
+    walk.create = 0;
+    walk.flags = 0;
+    walk.delta = (uint64_t) to - ((uint64_t) from & ~(PAGE_SIZE - 1ULL));
+    walk.pte_fn = move_pte;
+
+    return run_range_walk(&kernel_as, from, size, &walk);
+}
+
+/** @brief Changes the protection of the mapped pages of a virtual range.
+ *
+ * @param addr start of the range, rounded down to a page.
+ * @param size length of the range in bytes, rounded up to whole pages.
+ * @param flags the MMU_MAP_* protection flags to apply.
+ * @returns EXIT_SUCCESS.
+ */
+int MMU_protect_range(void *addr, uint64_t size, int flags) {
+    struct range_walk walk;
+
+    walk.create = 0;
+    walk.flags = flags;
+    walk.pte_fn = protect_pte;
+    run_range_walk(&kernel_as, addr, size, &walk);
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Returns the level 1 entry mapping |addr|, or NULL if there is none.
+ *
+ * Unlike walk_page_table() this never creates tables.
+ */
+static PT *find_pte(PML4 *pml4, uint64_t addr) {
+    PDP *table = (PDP *) pml4;
+    int shift;
+
+    for (shift = PML4_OFFSET_SHIFT; shift > PT_OFFSET_SHIFT; shift -= 9) {
+        table = &table[(addr >> shift) & VIRT_ADDR_MASK];
+        if (!table->present || table->ps)
+            return NULL;
+        table = entry_table(table);
+    }
+
+    return (PT *) &table[(addr >> PT_OFFSET_SHIFT) & VIRT_ADDR_MASK];
+}
+
+/** @brief Zeroes a kernel range, skipping pages that are known to be zero.
+ *
+ * A page is known to be zero if it is still waiting to be backed on demand,
+ * or is backed by a PG_ZERO frame and has not been written since.
+ */
+void MMU_clear_range(void *addr, uint64_t size) {
+    uint64_t start = (uint64_t) addr, end = start + size, next;
+    PT *pte;
+
+    for (; start < end; start = next) {
+        next = (start & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+        if (next > end)
+            next = end;
+
+        pte = find_pte(page_map_l4, start);
+        if (pte && ((!pte->present && pte->avl & ALLOC_ON_DEMAND) ||
+         (pte->present && !pte->d && pages[pte->base_addr].flags & PG_ZERO)))
+            zero_stats.skipped++;
+        else
+            memset((void *) start, 0, next - start);
+    }
+}
+
+/** @brief Translates |addr| in the page tables of |as|.
+ *
+ * Reads every level through the direct map, so it works for any space.
+ * @param as the address space, or NULL for the kernel page tables.
+ * @returns The physical address, or 0 if |addr| is not mapped.
+ */
+uint64_t MMU_translate(MMU_addr_space *as, void *addr) {
+    uint64_t virt = (uint64_t) addr, mask;
+    PDP *table = (PDP *) (as ? as->pml4 : page_map_l4);
+    int shift;
+
+    for (shift = PML4_OFFSET_SHIFT; shift >= PT_OFFSET_SHIFT; shift -= 9) {
+        table = &table[(virt >> shift) & VIRT_ADDR_MASK];
+        if (!table->present)
+            return 0;
+
+        if (shift == PT_OFFSET_SHIFT || table->ps) {
+            mask = (1ULL << shift) - 1;
+            return (((uint64_t) table->base_addr << PT_OFFSET_SHIFT) & ~mask) |
+             (virt & mask);
+        }
+        table = entry_table(table);
+    }
+
+    return 0;
+}
+
+/** @brief Maps a range of |as| for allocation on demand.
+ *
+ * Same as MMU_map_range() but for any address space.
+ */
+int MMU_as_map_range(MMU_addr_space *as, void *addr, uint64_t size, 
+ int flags) {
+    struct range_walk walk;
+
+    walk.create = 1;
+    walk.flags = flags;
+    walk.pte_fn = map_pte;
+
+    return run_range_walk(as, addr, size, &walk);
+}
+
+/** @brief Unmaps a range of |as| and frees the frames backing it. */
+int MMU_as_unmap_range(MMU_addr_space *as, void *addr, uint64_t size) {
+    struct range_walk walk;
+
+    walk.create = 0;
+    walk.flags = 0;
+    walk.pte_fn = unmap_pte;
+    run_range_walk(as, addr, size, &walk);
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Frees a page table and every lower level table below it.
+ *
+ * @param shift the address bit that indexes |table|.
+ * @pre The level 1 entries have already been unmapped.
+ */
+static void free_tables(PDP *table, int shift) {
+    int i;
+
+    if (shift > PT_OFFSET_SHIFT)
+        for (i = 0; i < PT_ENTRIES; i++)
+            if (table[i].present && !table[i].ps)
+                free_tables(entry_table(&table[i]), shift - 9);
+
+    MMU_pf_free((void *) virt_to_phys(table));
+}
+
+/** @brief Creates an address space with an empty user half.
+ *
+ * The kernel entries of the new PML4 are copied from the kernel page tables. 
+ * They point at the same PDPTs, so kernel mappings made later show up in 
+ * every space.
+ * @returns The address space with one reference, or NULL on failure.
+ */
+MMU_addr_space *MMU_create_addr_space(void) {
+    MMU_addr_space *as;
+    void *pml4;
+    int i, ints_enabled = 0;
+
+    as = kmalloc(sizeof(MMU_addr_space));
+    if (!as)
+        return NULL;
+
+    pml4 = MMU_pf_alloc();
+    if (!pml4) {
+        kfree(as);
+        return NULL;
+    }
+    as->pml4 = phys_to_virt((uint64_t) pml4);
 
-    /* Populate free list with addresses from lower memory region. */
-    ptr = free_list_head;
-    while ((uint64_t) ptr < mem_info.low.address + mem_info.low.size - 
-     PAGE_SIZE) {
-        address = (uint64_t) ptr;
-        ptr->next = (page_frame *) (address + PAGE_SIZE);
-        ptr = ptr->next;
+    for (i = 0; i < PT_ENTRIES; i++) {
+        if (i < USER_PML4_FIRST || i >= USER_PML4_END)
+            as->pml4[i] = page_map_l4[i];
+        else
+            memset(&as->pml4[i], 0, sizeof(PML4));
     }
 
-    /* Set start of free memory not in free pool. */
-    address = mem_info.high.address;
-    if (address < mem_info.kern_start + mem_info.kern_size)
-        address = mem_info.kern_start + mem_info.kern_size;
+    /* Spaces that fell back to KERNEL_PCID share it and flush on each load. */
+    as->pcid = TLB_alloc_pcid();
+    as->cr3 = TLB_make_cr3((uint64_t) pml4, as->pcid, as->pcid != KERNEL_PCID);
+    as->refcount = 1;
 
-    if (address % PAGE_SIZE) /* Round up to PAGE_SIZE. */
-        address += PAGE_SIZE - address % PAGE_SIZE;
+    /* Drop anything a previous owner of the PCID left in the TLB. */
+    if (as->pcid != KERNEL_PCID) {
+        if (are_interrupts_enabled()) {
+            ints_enabled = 1;
+            CLI;
+        }
 
-    phys_blocks = (uint8_t *) address;
-    untracked_bytes_left = mem_info.high.size;
+        flush_addr_space(as);
 
-    if (ints_enabled)
-        STI;
+        if (ints_enabled)
+            STI;
+    }
+
+    return as;
 }
 
-/** @brief Allocates a page frame.
+/** @brief Copies the level 1 entry |src| into |dst| for a clone.
  *
- * Searches memory for a free page and returns it.
- * @returns A pointer to the start of a page frame or NULL if no more free
- * pages exist.
- * @pre Multiboot 2 type 6 (memory) and 9 (ELF sections) tags have been parsed 
- * and information stored in the global MB_mem_info struct.
- * @post A free page frame has been allocated and tracked.
+ * With |cow| the frame is shared and a writable page becomes read-only 
+ * copy-on-write in both spaces. Otherwise, or if the frame cannot take 
+ * another reference, a present page is copied right away.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if no frame is available.
  */
-void *MMU_pf_alloc(void) {
-    void *ret = NULL;
-    int ints_enabled = 0;
-    page_frame *pf;
+static int clone_pte(PT *src, PT *dst, int cow) {
+    uint64_t pfn = src->base_addr;
+    void *frame;
 
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
-    }
+    *dst = *src;
+    if (!src->present)
+        return EXIT_SUCCESS;
 
-    if (phys_blocks) { /* Get page directly from memory. */
+    if (cow && 
+     MMU_pf_get((void *) (pfn << PT_OFFSET_SHIFT)) == EXIT_SUCCESS) {
+        if (src->r_w || src->avl & COPY_ON_WRITE) {
+            src->r_w = dst->r_w = 0;
+            src->avl |= COPY_ON_WRITE;
+            dst->avl |= COPY_ON_WRITE;
+        }
 
-        /* Check if memory block is less than a full page. */
-        if (untracked_bytes_left >= PAGE_SIZE) {
-            ret = (void *) phys_blocks;
-            phys_blocks += PAGE_SIZE;
-            untracked_bytes_left -= PAGE_SIZE;
+        return EXIT_SUCCESS;
+    }
 
-        }
-        else
-            ret = NULL;
+    frame = MMU_pf_alloc();
+    if (!frame) {
+        dst->present = 0;
+        dst->base_addr = 0;
+        return EXIT_FAILURE;
+    }
+    memcpy(phys_to_virt((uint64_t) frame), phys_to_virt(pfn << PT_OFFSET_SHIFT),
+     PAGE_SIZE);
 
-        if (untracked_bytes_left < PAGE_SIZE)
-            phys_blocks = NULL;
+    dst->base_addr = (uint64_t) frame >> PT_OFFSET_SHIFT;
+    if (dst->avl & COPY_ON_WRITE) { /* The copy is private. */
+        dst->avl &= ~COPY_ON_WRITE;
+        dst->r_w = 1;
     }
-    else if (free_list_head) { /* Get page from free list. */
-        if (free_list_head) {
-            pf = free_list_head;
-            free_list_head = free_list_head->next;
-            ret = (void *) pf;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Clones the entries of |src| into |dst|, creating lower tables.
+ *
+ * @param shift the address bit that indexes the tables.
+ */
+static int clone_table(PDP *src, PDP *dst, int shift, int cow) {
+    int i, ret = EXIT_SUCCESS;
+    void *table;
+
+    for (i = 0; i < PT_ENTRIES && ret == EXIT_SUCCESS; i++) {
+        if (shift == PT_OFFSET_SHIFT)
+            ret = clone_pte((PT *) &src[i], (PT *) &dst[i], cow);
+        else if (src[i].present && !src[i].ps) {
+            table = next_table(&dst[i]);
+            dst[i].u_s = src[i].u_s;
+            ret = clone_table(entry_table(&src[i]), table, shift - 9, cow);
         }
     }
-    else
-        ret = NULL;
-
-    if (ints_enabled)
-        STI;
 
     return ret;
 }
 
-/** @brief Frees a page frame.
+/** @brief Creates a copy of the user half of |as|.
  *
- * Frees a page frame and stores it in the free list.
- *
- * @param pf a pointer to the page frame to be freed.
- * @pre A page frame has been allocated.
- * @post pf is added to the free list.
+ * With |cow| the frames are shared copy-on-write, so only pages that either
+ * space later writes get copied, one at a time, by the page fault handler. 
+ * Otherwise every present page is copied now.
+ * @returns The new address space with one reference, or NULL on failure.
  */
-int MMU_pf_free(void *pf) {
-    page_frame *frame = pf;
-    int ints_enabled = 0;
+MMU_addr_space *MMU_clone_addr_space(MMU_addr_space *as, int cow) {
+    MMU_addr_space *clone;
+    int i, ret = EXIT_SUCCESS, ints_enabled = 0;
+
+    clone = MMU_create_addr_space();
+    if (!clone)
+        return NULL;
 
     if (are_interrupts_enabled()) {
         ints_enabled = 1;
         CLI;
     }
 
-    /* Received a non-NULL pointer that is 4K aligned. */
-    if (pf && !((uint64_t) frame % PAGE_SIZE)) {
-        /* Add page frame to the free pool. */
-        frame->next = free_list_head;
-        free_list_head = frame;
-
-        if (ints_enabled)
-            STI;
+    for (i = USER_PML4_FIRST; i < USER_PML4_END && ret == EXIT_SUCCESS; i++)
+        if (as->pml4[i].present)
+            ret = clone_table(entry_table((PDP *) &as->pml4[i]),
+             next_table((PDP *) &clone->pml4[i]), PDP_OFFSET_SHIFT, cow);
 
-        return EXIT_SUCCESS;
-    }
+    /* Writable translations of the source may be cached. */
+    if (cow)
+        flush_addr_space(as);
 
     if (ints_enabled)
         STI;
 
-    return EXIT_FAILURE;
+    if (ret != EXIT_SUCCESS) {
+        MMU_addr_space_put(clone);
+        return NULL;
+    }
+
+    return clone;
 }
 
-/** @brief Walks the page table.
+/** @brief Takes a reference to |as|. */
+void MMU_addr_space_get(MMU_addr_space *as) {
+
+    if (as)
+        __sync_fetch_and_add(&as->refcount, 1);
+}
+
+/** @brief Drops a reference to |as|, destroying it with the last one.
  *
- * @returns 
- * @pre PML4 must exist.
- * @post 
+ * Frees every user page, the user page tables, the PML4 and the PCID. If 
+ * |as| is still loaded, the kernel page tables are loaded first.
  */
-static int walk_page_table(uint64_t addr, PML4 *pml4, PT **pt) {
-    uint64_t index;
-    int ints_enabled = 0;
-    PDP *pdp;
-    PD *pd;
+void MMU_addr_space_put(MMU_addr_space *as) {
+    int i, ints_enabled = 0;
 
-    if (!pml4)
-        return -1;
+    if (!as || as == &kernel_as || __sync_sub_and_fetch(&as->refcount, 1))
+        return;
 
     if (are_interrupts_enabled()) {
         ints_enabled = 1;
         CLI;
     }
 
-    index = (addr >> PML4_OFFSET_SHIFT) & VIRT_ADDR_MASK;
-    if (!pml4[index].present) { /* Create PDP if not present. */
-        pml4[index].present = 1;
-        pml4[index].r_w = 1;
-
-        pdp = MMU_pf_alloc();
-        if (pdp == NULL) {
-            printk("MMU_pf_alloc failed to alloc a PDP\n");
-            HALT_CPU
-        }
-        pml4[index].base_addr = (uint64_t) pdp >> PT_OFFSET_SHIFT;
-        memset(pdp, 0, PAGE_SIZE);
-    }
-    else /* PDP is present. */
-        pdp = (PDP *) ((uint64_t) page_map_l4[index].base_addr << 
-         PT_OFFSET_SHIFT);
-
-    index = (addr >> PDP_OFFSET_SHIFT) & VIRT_ADDR_MASK;
-    if (!pdp[index].present) { /* Create PD if not present. */
-        pd = MMU_pf_alloc();
-        if (pd == NULL) {
-            printk("MMU_pf_alloc failed to alloc a PD\n");
-            HALT_CPU
-        }
-        pdp[index].base_addr = (uint64_t) pd >> PT_OFFSET_SHIFT;
-
-        pdp[index].present = 1;
-        pdp[index].r_w = 1;
-        memset(pd, 0, PAGE_SIZE);
-    }
-    else /* PD is present. */
-        pd = (PD *) ((uint64_t) pdp[index].base_addr << PT_OFFSET_SHIFT);
+    if (addr_space_loaded(as))
+        write_cr3(kernel_as.cr3);
 
-    index = (addr >> PD_OFFSET_SHIFT) & VIRT_ADDR_MASK;
-    if (!pd[index].present) { /* Create page table if not present. */
-        *pt = MMU_pf_alloc();
-        if (*pt == NULL) {
-            printk("MMU_pf_alloc failed to alloc a PT\n");
-            HALT_CPU
-        }
+    MMU_as_unmap_range(as, (void *) USER_ADDR, 
+     ((uint64_t) USER_PML4_END << PML4_OFFSET_SHIFT) - USER_ADDR);
+    for (i = USER_PML4_FIRST; i < USER_PML4_END; i++)
+        if (as->pml4[i].present)
+            free_tables(entry_table((PDP *) &as->pml4[i]), PDP_OFFSET_SHIFT);
 
-        pd[index].base_addr = (uint64_t) *pt >> PT_OFFSET_SHIFT;
-        pd[index].present = 1;
-        pd[index].r_w = 1;
-        memset(*pt, 0, PAGE_SIZE);
-    }
-    else { /* Page table is present. */
-        *pt = (PT *) ((uint64_t) pd[index].base_addr << PT_OFFSET_SHIFT);
-    }
+    MMU_pf_free((void *) virt_to_phys(as->pml4));
+    TLB_free_pcid(as->pcid);
 
     if (ints_enabled)
         STI;
 
-    return (addr >> PT_OFFSET_SHIFT) & VIRT_ADDR_MASK;
+    kfree(as);
 }
 
-/** @brief Initializes virtual memory management.
+/** @brief Loads the page tables of |as| unless they are already loaded.
  *
- * @post The virtual memory manager is initialized.
+ * @param as the space to switch to, or NULL for the kernel page tables.
  */
-int MMU_init() {
-    int ints_enabled = 0;
-    const uint64_t phys_mem_size = mem_info.high.address + mem_info.high.size;
-    uint64_t i, index;
-    CR3 cr3;
-    PT *pt;
-
-    /* 
-     * Need to:
-     *  - Create at least one PDPT per region. 
-     *  - Install the same PML4E entry in every address space.
-     *  - Updates to PDPE or lower levels does not require changing any
-     *    PML4 tables.
-     *  - Cross-compiler will place user space programs at address 0x10000
-     *    (where the kernel is located).
-     */
-
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
-    }
+void MMU_switch_addr_space(MMU_addr_space *as) {
 
-    /* Create level 4 page map. */
-    page_map_l4 = MMU_pf_alloc();
-    if (!page_map_l4) {
-        printk("MMU_pf_alloc error allocating PML4\n");
-        HALT_CPU
-    }
-    memset(page_map_l4, 0, PAGE_SIZE);
-
-    /* Create at least one PDPT per region. */
+    if (!as)
+        as = &kernel_as;
 
-    /* Identity map. */
-    for (i = 0; i < phys_mem_size; i += PAGE_SIZE) {
-        index = walk_page_table(i, page_map_l4, &pt);
-        pt[index].present = 1;
-        pt[index].r_w = 1;
+    if (!addr_space_loaded(as))
+        write_cr3(as->cr3);
+}
 
-        if (i) /* Set current address to be the actual page referenced. */
-            pt[index].base_addr = i >> PT_OFFSET_SHIFT;
-        else /* Do not map address zero. */
-            pt[index].base_addr = (uint64_t) MMU_pf_alloc() >> PT_OFFSET_SHIFT;
-    }
+/* Kernel heap functions. */
+void *MMU_alloc_page() {
 
-    /* Kernel stacks. */
-    next_kernel_stack = KSTACKS_ADDR;
+    return MMU_alloc_pages_flags(1, 0);
+}
 
-    /* Growth region. */
+void *MMU_alloc_pages(unsigned int num) {
 
-    /* Kernel heaps. */
-    next_virtual_address = KHEAP_ADDR; /* Set first kernel heap address. */
+    return MMU_alloc_pages_flags(num, 0);
+}
 
+/** @brief Allocates |num| contiguous kernel heap pages.
+ *
+ * @param flags MMU_MAP_POPULATE to back the pages with frames now rather 
+ * than on first touch.
+ */
+void *MMU_alloc_pages_flags(unsigned int num, int flags) {
+    uint64_t addr;
 
-    /* User space. */
+    addr = VMEM_alloc(&kpages_arena, (uint64_t) num * PAGE_SIZE);
+    if (!addr)
+        return NULL;
 
-    /* Set CR3 last. */
-    cr3.base_addr = (uint64_t) page_map_l4 >> PT_OFFSET_SHIFT;
-    cr3.reserved1 = 0;
-    cr3.reserved2 = 0;
-    cr3.reserved3 = 0;
-    __asm__("movq %0, %%cr3" : : "r"(cr3));
+    MMU_map_range((void *) addr, (uint64_t) num * PAGE_SIZE, 
+     MMU_MAP_WRITE | (flags & MMU_MAP_POPULATE));
 
-    /* Set IRQ handler. */
-    IRQ_set_handler(PAGE_FAULT, MMU_page_fault_handler, NULL);
+    return (void *) addr;
+}
 
-    if (ints_enabled)
-        STI;
+void MMU_free_page(void *page) {
 
-    return EXIT_SUCCESS;
+    MMU_free_pages(page, 1);
 }
 
-/* Kernel heap functions. */
-void *MMU_alloc_page() {
-    PT *pt;
-    uint64_t index = walk_page_table(next_virtual_address, page_map_l4, &pt);
-    void *ret;
-    int ints_enabled = 0;
+/** @brief Frees pages from MMU_alloc_pages() or the kernel heap.
+ *
+ * Pages from MMU_alloc_pages() return their virtual range for reuse, so they
+ * must be freed whole: |page| is the address MMU_alloc_pages() returned and
+ * |num| the number of pages it was last sized to. Halts otherwise rather than
+ * leak the frames.
+ */
+void MMU_free_pages(void *page, unsigned int num) {
+    uint64_t size = (uint64_t) num * PAGE_SIZE;
 
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
+    if (VMEM_contains(&kpages_arena, (uint64_t) page)) {
+        if (VMEM_size(&kpages_arena, (uint64_t) page) != size) {
+            printk("MMU_free_pages: %p is not an allocation of %u pages\n", 
+             page, num);
+            HALT_CPU
+        }
+        VMEM_free(&kpages_arena, (uint64_t) page);
     }
 
-    pt[index].avl = ALLOC_ON_DEMAND; /* Set on demand allocation bit. */
-    pt[index].present = 0; /* Will mark present after handler allocs page.  */
-
-    ret = (void *) next_virtual_address;
-    next_virtual_address += PAGE_SIZE;
-
-    if (ints_enabled)
-        STI;
-
-    return ret;
+    MMU_unmap_range(page, size);
 }
 
-void *MMU_alloc_pages(unsigned int num) {
-    void *ret;
-    int i, ints_enabled = 0;
-
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
+/** @brief Resizes an allocation from MMU_alloc_pages() to |num| pages.
+ *
+ * Shrinking unmaps the tail. Growing extends the virtual range in place when
+ * the range after it is free and otherwise moves the page table entries to a
+ * new range. Either way no data is copied and new pages are mapped on demand.
+ * @returns The possibly moved pages, or NULL if |page| is not from
+ * MMU_alloc_pages(), no virtual range is large enough or the new range could
+ * not be mapped, in which case |page| is left as it was.
+ */
+void *MMU_realloc_pages(void *page, unsigned int num) {
+    uint64_t old_size = VMEM_size(&kpages_arena, (uint64_t) page);
+    uint64_t size = (uint64_t) num * PAGE_SIZE, addr;
+
+    if (!old_size || !num)
+        return NULL;
+
+    if (size <= old_size) {
+        if (size < old_size && 
+         VMEM_resize(&kpages_arena, (uint64_t) page, size) == EXIT_SUCCESS)
+            MMU_unmap_range((char *) page + size, old_size - size);
+        return page;
     }
 
-    ret = MMU_alloc_page();
-    for (i = 1; i < num; i++)
-        MMU_alloc_page();
+    if (VMEM_resize(&kpages_arena, (uint64_t) page, size) == EXIT_SUCCESS) {
+        if (MMU_map_range((char *) page + old_size, size - old_size, 
+         MMU_MAP_WRITE) != EXIT_SUCCESS) {
+            MMU_unmap_range((char *) page + old_size, size - old_size);
+            VMEM_resize(&kpages_arena, (uint64_t) page, old_size);
+            return NULL;
+        }
+        return page;
+    }
 
-    if (ints_enabled)
-        STI;
+    addr = VMEM_alloc(&kpages_arena, size);
+    if (!addr)
+        return NULL;
+
+    if (MMU_map_range((char *) addr + old_size, size - old_size, 
+     MMU_MAP_WRITE) != EXIT_SUCCESS || 
+     MMU_move_range(page, (void *) addr, old_size) != EXIT_SUCCESS) {
+        /* Put back whatever moved and give up the new range. */
+        MMU_move_range((void *) addr, page, old_size);
+        MMU_unmap_range((void *) addr, size);
+        VMEM_free(&kpages_arena, addr);
+        return NULL;
+    }
+    VMEM_free(&kpages_arena, (uint64_t) page);
 
-    return ret;
+    return (void *) addr;
 }
 
-void MMU_free_page(void *page) {
-    PT *pt;
-    uint64_t index, addr;
-    int ints_enabled = 0;
+/** @brief Returns the bytes MMU_alloc_pages() handed out at |page|, or 0 if
+ * |page| is not the start of such an allocation.
+ */
+uint64_t MMU_pages_size(void *page) {
 
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
-    }
+    return VMEM_size(&kpages_arena, (uint64_t) page);
+}
 
-    index = walk_page_table((uint64_t) page, page_map_l4, &pt);
-    addr = (pt[index].base_addr << PT_OFFSET_SHIFT);
-    MMU_pf_free((void *) addr);
+/** @brief Copies the usage counters of a virtual memory region.
+ *
+ * @param region MMU_REGION_KSTACKS or MMU_REGION_KPAGES.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE for an unknown region.
+ */
+int MMU_region_stats(int region, VMEM_stats *stats) {
 
-    pt[index].present = 0;
-    pt[index].avl &= !ALLOC_ON_DEMAND;
+    if (region == MMU_REGION_KSTACKS)
+        VMEM_get_stats(&kstack_arena, stats);
+    else if (region == MMU_REGION_KPAGES)
+        VMEM_get_stats(&kpages_arena, stats);
+    else
+        return EXIT_FAILURE;
 
-    if (ints_enabled)
-        STI;
+    return EXIT_SUCCESS;
 }
 
-void MMU_free_pages(void *page, unsigned int num) {
-    PT *pt;
-    uint64_t index, addr = (uint64_t) page;
-    int i, ints_enabled = 0;
-
-    if (are_interrupts_enabled()) {
-        ints_enabled = 1;
-        CLI;
+/** @brief Gives a copy-on-write entry a private, writable frame.
+ *
+ * The frame is copied only if another mapping still shares it.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if no frame is available.
+ */
+static int break_cow(PT *pte) {
+    uint64_t pfn = pte->base_addr;
+    void *frame;
+
+    if (pages[pfn].refcount > 1) {
+        frame = MMU_pf_alloc();
+        if (!frame)
+            return EXIT_FAILURE;
+
+        memcpy(phys_to_virt((uint64_t) frame),
+         phys_to_virt(pfn << PT_OFFSET_SHIFT), PAGE_SIZE);
+        MMU_pf_put((void *) (pfn << PT_OFFSET_SHIFT));
+        pte->base_addr = (uint64_t) frame >> PT_OFFSET_SHIFT;
+        fault_stats.cow_copies++;
     }
+    else
+        fault_stats.cow_reuses++;
 
-    for (i = 0; i < num; i++, addr += PAGE_SIZE)
-        MMU_free_page((void *) addr);
+    pte->avl &= ~COPY_ON_WRITE;
+    pte->r_w = 1;
 
-    if (ints_enabled)
-        STI;
+    return EXIT_SUCCESS;
 }
 
 /* Page fault handler. */
@@ -411,13 +2089,13 @@ extern void MMU_page_fault_handler(int irq, int error, void *arg) {
     CR3 cr3;
     PML4 *pml4;
     PT *pt;
-    int index;
+    int index, first, i;
     uint64_t mem_addr;
 
     /* Get PML4 address. */
     __asm__("movq %%cr3, %0" : "=r"(mem_addr));
     memcpy(&cr3, &mem_addr, sizeof(CR3));
-    pml4 = (PML4 *) ((uint64_t) cr3.base_addr << PT_OFFSET_SHIFT);
+    pml4 = phys_to_virt((uint64_t) cr3.base_addr << PT_OFFSET_SHIFT);
 
     /* Get offending memory address. */
     __asm__("movq %%cr2, %0" : "=r"(mem_addr));
@@ -425,15 +2103,38 @@ extern void MMU_page_fault_handler(int irq, int error, void *arg) {
     /* Find level 1 table. */
     index = walk_page_table(mem_addr, pml4, &pt);
 
-    if (pt[index].avl & ALLOC_ON_DEMAND) {
-        pt[index].base_addr = (uint64_t) MMU_pf_alloc() >> PT_OFFSET_SHIFT;
-        pt[index].present = 1;
-        pt[index].avl &= !ALLOC_ON_DEMAND;
+    if (index != PT_TRAVERSAL_ERROR && (error & PF_ERR_PRESENT) && 
+     (error & PF_ERR_WRITE) && pt[index].avl & COPY_ON_WRITE) {
+        if (break_cow(&pt[index]) != EXIT_SUCCESS) {
+            printk("MMU_pf_alloc failed copying page %p\n", (void *) mem_addr);
+            HALT_CPU
+        }
+
+        TLB_flush_page((void *) mem_addr);
+    }
+    else if (index != PT_TRAVERSAL_ERROR && pt[index].avl & ALLOC_ON_DEMAND) {
+        fault_stats.faults++;
 
-        if (pt[index].base_addr == 0) { /* Check if MMU_pf_alloc failed. */
+        if (back_pte(&pt[index]) != EXIT_SUCCESS) {
             printk("MMU_pf_alloc failed in  MMU_page_fault_handler!\n");
             HALT_CPU
         }
+
+        /* Back the on demand neighbours in the aligned fault around window. */
+        first = index & ~(fault_around_pages - 1);
+        for (i = first; i < first + fault_around_pages; i++) {
+            if (i == index || !(pt[i].avl & ALLOC_ON_DEMAND) || pt[i].present)
+                continue;
+
+            if (back_pte(&pt[i]) != EXIT_SUCCESS)
+                break;
+            fault_stats.faulted_around++;
+        }
+    }
+    else if (VMEM_contains(&kstack_arena, mem_addr) && 
+     mem_addr % KSTACK_SIZE < PAGE_SIZE) {
+        printk("Kernel stack overflow at %p\n", (void *) mem_addr);
+        HALT_CPU
     }
     else {
         printk("Error in MMU_page_fault_handler handling address %p\n", 
@@ -442,6 +2143,34 @@ extern void MMU_page_fault_handler(int irq, int error, void *arg) {
     }
 }
 
+/** @brief Sets how many pages a demand fault backs at once.
+ *
+ * @param pages size of the aligned window around a faulting page, rounded 
+ * down to a power of two and capped at one page table. 1 disables fault 
+ * around.
+ */
+void MMU_set_fault_around(unsigned int pages) {
+    unsigned int window = 1;
+
+    while (window * 2 <= pages && window * 2 <= PT_ENTRIES)
+        window *= 2;
+
+    fault_around_pages = window;
+}
+
+/** @brief Copies the demand paging counters into |stats|. */
+void MMU_fault_stats(MEM_fault_stats *stats) {
+
+    memcpy(stats, &fault_stats, sizeof(MEM_fault_stats));
+}
+
+/** @brief Moves the end of the kernel heap.
+ *
+ * The break stays page aligned. Growing rounds |increment| up to whole pages
+ * and maps them for allocation on demand. Shrinking rounds it down, so no page
+ * that is still in use is lost, and unmaps the pages, returning their frames.
+ * @returns The old break, or (void *) -1 if it would leave the heap region.
+ */
 void *kbrk(intptr_t increment) {
     uint64_t size;
     int remainder, ints_enabled = 0;
@@ -455,11 +2184,19 @@ void *kbrk(intptr_t increment) {
     if (!increment)
         ret = (void *) next_virtual_address;
     else if (increment < 0) {
-        ret = (void *) next_virtual_address;
-        /*
-        printk("kbrk error: increment %p\n", increment);
-        return (void *) -1;
-        */
+        size = (uint64_t) -increment / PAGE_SIZE * PAGE_SIZE;
+
+        if (next_virtual_address - KHEAP_ADDR < size) {
+            printk("kbrk error: increment %ld\n", (long) increment);
+            ret = (void *) -1;
+        }
+        else {
+            ret = (void *) next_virtual_address;
+            next_virtual_address -= size;
+            if (size)
+                MMU_free_pages((void *) next_virtual_address, 
+                 size / PAGE_SIZE);
+        }
     }
     else {
         size = (uint64_t) increment / PAGE_SIZE;
@@ -467,10 +2204,15 @@ void *kbrk(intptr_t increment) {
 
         if (remainder)
             size++;
+        size *= PAGE_SIZE;
 
-        ret = MMU_alloc_pages(size);
-        if (!ret)
+        if (next_virtual_address + size > KPAGES_ADDR)
             ret = (void *) -1;
+        else {
+            ret = (void *) next_virtual_address;
+            MMU_map_range(ret, size, MMU_MAP_WRITE);
+            next_virtual_address += size;
+        }
     }
 
     if (ints_enabled)
@@ -479,45 +2221,83 @@ void *kbrk(intptr_t increment) {
     return ret;
 }
 
+/** @brief Allocates a kernel stack.
+ *
+ * Pops a recently freed stack from the cache when possible, so thread 
+ * creation does not touch the page tables. Otherwise a new KSTACK_SIZE slot 
+ * is mapped with its lowest page left unmapped as a guard, making an overflow
+ * fault instead of running into the neighbouring stack.
+ * @returns The initial stack pointer, or NULL if out of stack space.
+ */
 void *MMU_alloc_kstack() {
-    PT *pt;
-    uint64_t index;
-    void *ret;
+    uint64_t stack;
     int ints_enabled = 0;
-    unsigned long long i, stack_end;
 
     if (are_interrupts_enabled()) {
         ints_enabled = 1;
         CLI;
     }
 
-    stack_end = next_kernel_stack + KSTACK_SIZE;
-    for (i = next_kernel_stack; i < stack_end; i += PAGE_SIZE) {
-        index = walk_page_table(i, page_map_l4, &pt);
-        pt[index].avl = ALLOC_ON_DEMAND; /* Set on demand allocation bit. */
-        pt[index].present = 0;
+    if (kstack_cache_count) {
+        stack = kstack_cache[--kstack_cache_count];
+        kstack_stats.hits++;
+    }
+    else {
+        kstack_stats.misses++;
+
+        /* Freed stacks are reused through the arena. */
+        stack = VMEM_alloc(&kstack_arena, KSTACK_SIZE);
+        if (stack)
+            /* One walk per level 1 table covers the whole stack. */
+            MMU_map_range((void *) (stack + PAGE_SIZE), 
+             KSTACK_SIZE - PAGE_SIZE, MMU_MAP_WRITE);
     }
-    /* Advance to next stack since stacks grow downward. */
-    next_kernel_stack += KSTACK_SIZE;
 
-    /* Make sure stack aligned and before the next stack. */
-    ret = (void *) next_kernel_stack - STACK_ALLIGN;
+    if (stack && ++kstack_stats.in_use > kstack_stats.high_water)
+        kstack_stats.high_water = kstack_stats.in_use;
+    kstack_stats.cached = kstack_cache_count;
 
     if (ints_enabled)
         STI;
 
-    return ret;
+    if (!stack)
+        return NULL;
+
+    /* Start at the top since stacks grow downward, keeping alignment. */
+    return (void *) (stack + KSTACK_SIZE - STACK_ALLIGN);
 }
 
+/** @brief Frees the kernel stack containing |ptr|.
+ *
+ * The stack stays mapped in the cache if there is room, otherwise its frames
+ * and virtual range are released.
+ */
 void MMU_free_kstack(void *ptr) {
     uint64_t addr = (uint64_t) ptr;
-    int pages;
+    int ints_enabled = 0;
 
     addr -= addr % KSTACK_SIZE;
-    pages = KSTACK_SIZE / PAGE_SIZE;
 
-    if (KSTACK_SIZE % PAGE_SIZE)
-        pages++;
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    kstack_stats.in_use--;
+    if (kstack_cache_count < KSTACK_CACHE_SIZE)
+        kstack_cache[kstack_cache_count++] = addr;
+    else {
+        MMU_unmap_range((void *) addr, KSTACK_SIZE);
+        VMEM_free(&kstack_arena, addr);
+    }
+    kstack_stats.cached = kstack_cache_count;
+
+    if (ints_enabled)
+        STI;
+}
+
+/** @brief Copies the kernel stack cache counters into |stats|. */
+void MMU_kstack_stats(MEM_kstack_stats *stats) {
 
-    MMU_free_pages((void *) addr, pages);
+    memcpy(stats, &kstack_stats, sizeof(MEM_kstack_stats));
 }
@@ -2,22 +2,36 @@
 #define _MEMORY_H
 
 #include "../lib/stdint.h"
+#include "vmem.h"
 
 /* Virtual Address Space Layout:
  *
- * Identity map         0x0
+ * Identity map         0x0 (first BOOT_MAP_SIZE bytes, kernel image)
  * Kernel stacks        0x10000000000
  * Reserved/Growth      0x20000000000
- * Kernel heap          0xF0000000000
+ * Kernel heap (kbrk)   0xF0000000000
+ * Kernel pages         0xF8000000000
  * User space           0x100000000000
+ * Direct map           0xFFFF800000000000 (all physical memory)
  */
 
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+#define PF_MAX_ORDER 10 /* Largest buddy block is 2^10 frames (4 MiB). */
+#define MEM_MAX_NODES 8 /* NUMA nodes with their own page frame zone. */
 #define KSTACKS_ADDR 0x10000000000ULL
 #define KRESERVED_ADDR 0x20000000000ULL
 #define KHEAP_ADDR 0xF0000000000ULL
+#define KPAGES_ADDR 0xF8000000000ULL
+#define USER_ADDR 0x100000000000ULL
+#define DMAP_ADDR 0xFFFF800000000000ULL
 
-#define KSTACK_SIZE 0x200000ULL
+/* Virtual memory regions managed by a VMEM arena. */
+#define MMU_REGION_KSTACKS 0
+#define MMU_REGION_KPAGES 1
+
+#define KSTACK_SIZE 0x200000ULL /* Includes an unmapped guard page. */
 #define KHEAP_SIZE 0x200000ULL
 #define USR_STACK_SIZE 0x100000ULL
 #define USR_HEAP_SIZE 0x100000ULL
@@ -27,10 +41,75 @@ typedef struct {
     long length;
 } MEM_phys_block;
 
-/** @brief Node for the free list of page frames.
+/** @brief Counters of a per-CPU page frame magazine. */
+typedef struct {
+    uint64_t hits;    /* Allocations served from the magazine. */
+    uint64_t misses;  /* Allocations that found the magazine empty. */
+    uint64_t refills; /* Batches moved in from the buddy allocator. */
+    uint64_t drains;  /* Batches moved out to the buddy allocator. */
+} MEM_pf_mag_stats;
+
+/** @brief Page frame counters of one NUMA node. */
+typedef struct {
+    uint64_t present; /* Usable frames on the node. */
+    uint64_t free;    /* Frames in the node's free lists or uncarved. */
+    uint64_t used;    /* present - free. */
+    uint64_t local;   /* Blocks handed to a CPU on the node. */
+    uint64_t remote;  /* Blocks handed to another node that ran out. */
+    uint64_t frees;   /* Blocks returned to the node. */
+} MEM_node_stats;
+
+/** @brief Demand paging counters. */
+typedef struct {
+    uint64_t faults;         /* Demand faults taken. */
+    uint64_t faulted_around; /* Extra pages backed by fault around. */
+    uint64_t populated;      /* Pages backed up front by MMU_MAP_POPULATE. */
+    uint64_t cow_copies;     /* Shared pages copied on a write fault. */
+    uint64_t cow_reuses;     /* Write faults on pages no longer shared. */
+} MEM_fault_stats;
+
+/** @brief Zero pool counters. */
+typedef struct {
+    uint64_t hits;    /* Zeroed frames taken from the pool. */
+    uint64_t misses;  /* Frames zeroed on the spot. */
+    uint64_t zeroed;  /* Frames zeroed by MMU_zero_pool_fill(). */
+    uint64_t skipped; /* Pages MMU_clear_range() knew were zero. */
+    uint64_t pooled;  /* Frames currently in the pool. */
+} MEM_zero_stats;
+
+/** @brief Kernel stack cache counters. */
+typedef struct {
+    uint64_t hits;       /* Stacks popped from the cache. */
+    uint64_t misses;     /* Stacks that had to be mapped. */
+    uint64_t in_use;     /* Stacks currently allocated. */
+    uint64_t high_water; /* Most stacks ever allocated at once. */
+    uint64_t cached;     /* Stacks currently in the cache. */
+} MEM_kstack_stats;
+
+/* MEM_page flags. */
+#define PG_HEAD 0x1 /* First frame of an allocated block. */
+#define PG_ZERO 0x2 /* Zeroed when allocated. */
+#define PG_SLAB 0x4 /* Part of a slab, |owner| is the slab. */
+
+/** @brief Metadata of one page frame, in an array indexed by PFN.
+ *
+ * 16 bytes, so four share a cache line and the array costs 0.4% of memory.
+ */
+typedef struct page {
+    void *owner;       /* Object the frame belongs to, if any. */
+    uint32_t link;     /* PFN of the next frame on the owner's list. */
+    uint16_t refcount; /* Users of an allocated frame, 0 when free. */
+    uint8_t flags;     /* PG_* flags. */
+    uint8_t order;     /* Block order if PG_HEAD is set. */
+} MEM_page;
+
+/** @brief Node for the buddy free lists of page frames.
+ *
+ * Stored in the first bytes of the free block it describes.
  */
 typedef struct page_frame {
-    struct page_frame *next;
+    uint64_t next; /* Physical address of the next free block, or 0. */
+    uint64_t prev;
 } page_frame;
 
 /** @brief Structure of CR3 Register.
@@ -64,6 +143,12 @@ typedef struct page_map_level_4 {
     uint64_t nx:1;
 } __attribute__((packed)) PML4;
 
+/** @brief Structure of a PDP or PD entry.
+ *
+ * When |ps| is set the entry maps a 1 GiB (PDP) or 2 MiB (PD) page directly
+ * and |base_addr| must be aligned to that size. Bits 6 and 8 are then the
+ * dirty and global bits instead of being ignored.
+ */
 typedef struct page_directory_pointer_table {
     uint64_t present:1;
     uint64_t r_w:1;
@@ -72,8 +157,8 @@ typedef struct page_directory_pointer_table {
     uint64_t pcd:1;
     uint64_t a:1;
     uint64_t ign:1;
-    uint64_t zero:1;
-    uint64_t mbz:1;
+    uint64_t ps:1;          /* Page size. Set for a 1 GiB or 2 MiB page. */
+    uint64_t global_page:1; /* Only used when |ps| is set. */
     uint64_t avl:3;
     uint64_t base_addr:51;
     uint64_t nx:1;
@@ -96,20 +181,95 @@ typedef struct page_table {
     uint64_t nx:1;
 } __attribute__((packed)) PT;
 
+/** @brief A virtual address space.
+ *
+ * Every space shares the kernel PML4 entries and has private user entries.
+ * The context switch code reads |cr3| at offset 0.
+ */
+typedef struct MMU_addr_space {
+    uint64_t cr3;  /* Value to load into CR3, including the PCID. */
+    PML4 *pml4;
+    uint16_t pcid;
+    int refcount;
+} MMU_addr_space;
+
+/* Flags for MMU_map_range() and MMU_protect_range(). */
+#define MMU_MAP_WRITE 0x1
+#define MMU_MAP_USER 0x2
+#define MMU_MAP_NX 0x4
+#define MMU_MAP_POPULATE 0x8 /* Back with frames now, not on first touch. */
+
+extern uint64_t dmap_offset;
+
+/** @brief Returns a pointer through which physical address |phys| is reached.
+ *
+ * Before MMU_init() this goes through the boot identity map, afterwards
+ * through the direct map.
+ */
+static inline void *phys_to_virt(uint64_t phys) {
+
+    return (void *) (phys + dmap_offset);
+}
+
+/** @brief Returns the physical address of a pointer from phys_to_virt(). */
+static inline uint64_t virt_to_phys(void *virt) {
+
+    return (uint64_t) virt - dmap_offset;
+}
+
 /* Page frame allocator. */
 void MMU_pf_init();
 void *MMU_pf_alloc(void);
 int MMU_pf_free(void *pf);
+void *MMU_pf_alloc_order(unsigned int order);
+void *MMU_pf_alloc_node(int node, unsigned int order);
+int MMU_pf_free_order(void *pf, unsigned int order);
+uint64_t MMU_pf_free_count(void);
+void MMU_pf_mag_stats(unsigned int cpu, MEM_pf_mag_stats *stats);
+int MMU_num_nodes(void);
+int MMU_pf_node(void *pf);
+int MMU_node_stats(int node, MEM_node_stats *stats);
+MEM_page *MMU_pf_to_page(void *pf);
+void *MMU_page_to_pf(MEM_page *page);
+int MMU_pf_get(void *pf);
+int MMU_pf_put(void *pf);
+void *MMU_pf_alloc_zeroed(void);
+int MMU_zero_pool_fill(unsigned int max);
+void MMU_zero_thread(void *arg);
+void MMU_zero_stats(MEM_zero_stats *stats);
 
 /* Virtual page allocator. */
 int MMU_init();
 void *MMU_alloc_page();
 void *MMU_alloc_pages(unsigned int num);
+void *MMU_alloc_pages_flags(unsigned int num, int flags);
 void MMU_free_page(void *);
 void MMU_free_pages(void *, unsigned int num);
+void *MMU_realloc_pages(void *page, unsigned int num);
+int MMU_map_range(void *addr, uint64_t size, int flags);
+int MMU_unmap_range(void *addr, uint64_t size);
+int MMU_move_range(void *from, void *to, uint64_t size);
+int MMU_protect_range(void *addr, uint64_t size, int flags);
+void MMU_clear_range(void *addr, uint64_t size);
+uint64_t MMU_translate(MMU_addr_space *as, void *addr);
 extern void MMU_page_fault_handler(int irq, int error, void *arg);
+void MMU_set_fault_around(unsigned int pages);
+void MMU_fault_stats(MEM_fault_stats *stats);
 void *kbrk(intptr_t increment);
 void *MMU_alloc_kstack();
 void MMU_free_kstack(void *ptr);
+void MMU_kstack_stats(MEM_kstack_stats *stats);
+int MMU_region_stats(int region, VMEM_stats *stats);
+uint64_t MMU_pages_size(void *page);
+
+/* Address spaces. */
+MMU_addr_space *MMU_create_addr_space(void);
+void MMU_addr_space_get(MMU_addr_space *as);
+void MMU_addr_space_put(MMU_addr_space *as);
+void MMU_switch_addr_space(MMU_addr_space *as);
+MMU_addr_space *MMU_clone_addr_space(MMU_addr_space *as, int cow);
+int MMU_as_map_range(MMU_addr_space *as, void *addr, uint64_t size, 
+ int flags);
+int MMU_as_unmap_range(MMU_addr_space *as, void *addr, uint64_t size);
 
 #endif
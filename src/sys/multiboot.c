@@ -4,6 +4,7 @@
 #include "multiboot.h"
 #include "../lib/stdio.h"
 #include "../lib/stdlib.h"
+#include "../lib/string.h"
 #include <limits.h>
 
 #define HIGH_ADDR_START 0x9fc00
@@ -12,12 +13,13 @@
  *
  * Parses multiboot 2 tags. Finds relevant information for page frame allocator.
  * @param *mb_tag a MB_basic_tag pointer.
- * @returns MB_mem_info struct.
+ * @param *mem_info filled in with the memory map and kernel location. Passed
+ * by pointer since the map is too large for the 4 KiB boot stack.
  * @pre Correct pointer to multiboot 2 headers is found.
  * @post Multiboot 2 tags parsed and necessary information for page frame 
  * allocator about memory returned.
  */
-MB_mem_info MB_parse_tags(MB_basic_tag *mb_tag) {
+void MB_parse_tags(MB_basic_tag *mb_tag, MB_mem_info *mem_info) {
     int i, tag_size;
     uint8_t *ptr = (uint8_t *) mb_tag;
     uint8_t *mb_tag_end, *mmap_tag_end, *elf_tag_end;
@@ -26,10 +28,10 @@ MB_mem_info MB_parse_tags(MB_basic_tag *mb_tag) {
     MB_ELF_symb_tag *elf;
     MB_mmap_entry *mmap_entry;
     MB_ELF_section_header *elf_section;
-    MB_mem_info mem_info;
 
     mb_tag_end = (uint8_t *) (ptr + mb_tag->size);
     ptr += sizeof(MB_basic_tag);
+    mem_info->rsdp_size = 0;
 
     /* Parse all multiboot 2 tags. */
     while (ptr < mb_tag_end) {
@@ -48,6 +50,15 @@ MB_mem_info MB_parse_tags(MB_basic_tag *mb_tag) {
             mmap = (MB_mmap_tag *) (ptr + sizeof(MB_basic_tag));
             mmap_tag_end = ptr + tag_size;
         }
+        else if (fixed_header->type == MULTI_ACPI_NEW || 
+         (fixed_header->type == MULTI_ACPI_OLD && !mem_info->rsdp_size)) {
+            /* Prefer the 2.0 RSDP, which can point at an XSDT. */
+            mem_info->rsdp_size = fixed_header->size - sizeof(MB_basic_tag);
+            if (mem_info->rsdp_size > MB_RSDP_SIZE)
+                mem_info->rsdp_size = MB_RSDP_SIZE;
+            memcpy(mem_info->rsdp, ptr + sizeof(MB_basic_tag), 
+             mem_info->rsdp_size);
+        }
 
         ptr += tag_size; /* Advance to the next tag. */
     }
@@ -62,10 +73,10 @@ MB_mem_info MB_parse_tags(MB_basic_tag *mb_tag) {
      i < elf->num; elf_section++, i++) {
 
         if (i == 1)
-            mem_info.kern_start = elf_section->address;
+            mem_info->kern_start = elf_section->address;
         if (i == elf->num - 1)
-            mem_info.kern_size = (elf_section->address + elf_section->size) - 
-             mem_info.kern_start;
+            mem_info->kern_size = (elf_section->address + elf_section->size) - 
+             mem_info->kern_start;
     }
 
     /* Set up pointer to first mmap entry. */
@@ -73,20 +84,21 @@ MB_mem_info MB_parse_tags(MB_basic_tag *mb_tag) {
     ptr += sizeof(MB_mmap_tag);
     mmap_entry = (MB_mmap_entry *) ptr;
 
-    for (i = 0;mmap_entry <  (MB_mmap_entry *) mmap_tag_end; mmap_entry++) {
-
-        if (mmap_entry->type == MULTI_MEM_USABLE) {
-            if (!i) {
-                mem_info.low.address = mmap_entry->base_addr;
-                mem_info.low.size = mmap_entry->length;
-                i++;
-            }
-            else if (i == 1) {
-                mem_info.high.address = mmap_entry->base_addr;
-                mem_info.high.size = mmap_entry->length;
-            }
-        }
-    }
+    mem_info->num_regions = 0;
+    for (; mmap_entry < (MB_mmap_entry *) mmap_tag_end && 
+     mem_info->num_regions < MB_MAX_REGIONS; mmap_entry++) {
 
-    return mem_info;
+        if (!mmap_entry->length)
+            continue;
+
+        /* Insert sorted by base address. */
+        for (i = mem_info->num_regions; i > 0 && 
+         mem_info->regions[i - 1].address > mmap_entry->base_addr; i--)
+            mem_info->regions[i] = mem_info->regions[i - 1];
+
+        mem_info->regions[i].address = mmap_entry->base_addr;
+        mem_info->regions[i].size = mmap_entry->length;
+        mem_info->regions[i].type = mmap_entry->type;
+        mem_info->num_regions++;
+    }
 }
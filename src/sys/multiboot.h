@@ -8,7 +8,16 @@
 #define MULTI_ARCH 0
 #define MULTI_MMAP 6
 #define MULTI_ELF 9
+#define MULTI_ACPI_OLD 14 /* Copy of the ACPI 1.0 RSDP. */
+#define MULTI_ACPI_NEW 15 /* Copy of the ACPI 2.0+ RSDP. */
 #define MULTI_MEM_USABLE 1
+#define MULTI_MEM_RESERVED 2
+#define MULTI_MEM_ACPI 3 /* ACPI tables, reclaimable once parsed. */
+#define MULTI_MEM_NVS 4  /* ACPI non-volatile storage. */
+#define MULTI_MEM_BAD 5
+
+#define MB_MAX_REGIONS 64
+#define MB_RSDP_SIZE 36 /* Size of an ACPI 2.0 RSDP. */
 
 typedef struct {
     uint32_t magic;
@@ -83,15 +92,23 @@ typedef struct {
 typedef struct {
     uint64_t address;
     uint64_t size;
+    uint32_t type; /* One of the MULTI_MEM_* values. */
 } MB_mem_block;
 
+/** @brief Physical memory map and kernel location.
+ *
+ * Holds every region of the multiboot memory map, sorted by address, and a
+ * copy of the ACPI RSDP since the tags live in memory that gets reused.
+ */
 typedef struct {
-    MB_mem_block low;
-    MB_mem_block high;
-    long kern_start;
-    long kern_size;
+    MB_mem_block regions[MB_MAX_REGIONS];
+    int num_regions;
+    uint64_t kern_start;
+    uint64_t kern_size;
+    uint8_t rsdp[MB_RSDP_SIZE];
+    int rsdp_size; /* 0 if the loader passed no RSDP. */
 } MB_mem_info;
 
-MB_mem_info MB_parse_tags(MB_basic_tag *);
+void MB_parse_tags(MB_basic_tag *, MB_mem_info *);
 
 #endif
@@ -1,6 +1,6 @@
 #include "proc.h"
 #include "syscalls.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "memory.h"
 #include "../drivers/interrupts.h"
 #include "../lib/stdio.h"
@@ -16,6 +16,7 @@ static proc_t *main_proc_ptr;
 static ProcessQueue process_list, sched_list;
 static proc_t *process_list_tail, *sched_list_tail;
 static unsigned long long next_pid;
+static struct kmem_cache *proc_cache, *queue_cache;
 proc_t *cur_proc;
 proc_t *next_proc;
 
@@ -190,6 +191,20 @@ void PROC_yield_isr(int irq, int err, void *arg) {
     PROC_reschedule();
 }
 
+/** @brief Constructs a kernel thread with no context yet. */
+static void proc_ctor(void *obj) {
+    proc_t *proc = obj;
+
+    memset(proc, 0, sizeof(proc_t));
+    proc->cs = KERN_CS_OFFSET;
+}
+
+/** @brief Constructs an empty queue. */
+static void queue_ctor(void *obj) {
+
+    PROC_init_queue(obj, BLOCK);
+}
+
 void PROC_exit_isr(int irq, int err, void *arg) {
 
     unlink_proc(cur_proc, sched_list);
@@ -197,7 +212,10 @@ void PROC_exit_isr(int irq, int err, void *arg) {
 
     PROC_reschedule();
     MMU_free_kstack((void *) cur_proc->rsp);
-    kfree(cur_proc);
+    MMU_addr_space_put(cur_proc->as);
+    /* Clear the registers, links and pid so the next thread starts clean. */
+    proc_ctor(cur_proc);
+    kmem_cache_free(proc_cache, cur_proc);
     cur_proc = NULL;
 }
 
@@ -220,11 +238,13 @@ void PROC_init(void) {
     cur_proc = next_proc = NULL; /* No processes scheduled yet. */
     main_proc_ptr = NULL; /* Main process struct not created yet. */
 
+    proc_cache = kmem_cache_create("proc_t", sizeof(proc_t), 0, proc_ctor);
+    queue_cache = kmem_cache_create("process_queue", 
+     sizeof(struct process_queue), 0, queue_ctor);
+
     /* Initialize queues. */
-    process_list = kmalloc(sizeof( ProcessQueue));
-    sched_list = kmalloc(sizeof( ProcessQueue));
-    PROC_init_queue(process_list, PROCESS);
-    PROC_init_queue(sched_list, SCHEDULE);
+    process_list = PROC_create_queue(PROCESS);
+    sched_list = PROC_create_queue(SCHEDULE);
 
     process_list_tail = sched_list_tail = NULL;
     next_pid = 1; /* First pid. */
@@ -272,17 +292,15 @@ proc_t *PROC_create_kthread(kproc_t entry_point, void *arg) {
         CLI;
     }
 
-    proc = kmalloc(sizeof(proc_t));
-    if (proc == (void *) -1)
-        printk("kmalloc error in PROC_create_kthread\n");
+    /* Constructed objects are already zeroed kernel threads. */
+    proc = kmem_cache_alloc(proc_cache);
+    if (!proc)
+        printk("kmem_cache_alloc error in PROC_create_kthread\n");
     else {
-        memset(proc, 0, sizeof(proc_t)); /* Zero all fields. */
         proc->rip = (uint64_t) entry_point;
-        proc->cs = KERN_CS_OFFSET;
         proc->rsp = MMU_alloc_kstack();
 
         if (proc->rsp > 0) {
-            proc->ss = 0;
             proc->rflags = RFLAG_INT_ENABELED;
             proc->rdi = (uint64_t) arg;
 
@@ -298,8 +316,11 @@ proc_t *PROC_create_kthread(kproc_t entry_point, void *arg) {
             proc->pid = next_pid++;
             ret = proc;
         }
-        else
+        else {
             printk("MMU_alloc_kstack error\n");
+            proc_ctor(proc);
+            kmem_cache_free(proc_cache, proc);
+        }
     }
 
     if (ints_enabled)
@@ -308,6 +329,19 @@ proc_t *PROC_create_kthread(kproc_t entry_point, void *arg) {
     return ret;
 }
 
+/** @brief Makes |proc| run in |as|, or as a kernel thread if |as| is NULL.
+ *
+ * Takes a reference to |as| and drops the one held on the old space. The new
+ * space is loaded the next time |proc| is switched to.
+ */
+void PROC_set_addr_space(proc_t *proc, MMU_addr_space *as) {
+    MMU_addr_space *old = proc->as;
+
+    MMU_addr_space_get(as);
+    proc->as = as;
+    MMU_addr_space_put(old);
+}
+
 void PROC_block_on(ProcessQueue queue, int enable_ints) {
 
     if (!queue)
@@ -335,6 +369,22 @@ void PROC_unblock_all(ProcessQueue queue) {
         PROC_unblock_head(queue);
 }
 
+/** @brief Allocates an empty queue of |type|, or returns NULL. */
+ProcessQueue PROC_create_queue(Queue type) {
+    ProcessQueue queue = kmem_cache_alloc(queue_cache);
+
+    if (queue)
+        queue->queue_type = type;
+
+    return queue;
+}
+
+/** @brief Frees an empty queue from PROC_create_queue(). */
+void PROC_destroy_queue(ProcessQueue queue) {
+
+    kmem_cache_free(queue_cache, queue);
+}
+
 void PROC_init_queue(ProcessQueue queue, Queue type) {
     queue->head = NULL;
     queue->queue_type = type;
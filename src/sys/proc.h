@@ -39,6 +39,8 @@ typedef struct proc_t {
     struct proc_t *proc_prev;
     struct proc_t *sched_prev;
     struct proc_t *block_prev;
+    /* Address space, NULL for kernel threads. Read by the context switch. */
+    struct MMU_addr_space *as;
 } __attribute__ ((packed)) proc_t;
 
 typedef enum {PROCESS, SCHEDULE, BLOCK} Queue;
@@ -56,6 +58,7 @@ extern proc_t *next_proc;
 void PROC_init(void);
 void PROC_run(void);
 proc_t *PROC_create_kthread(kproc_t entry_point, void *arg);
+void PROC_set_addr_space(proc_t *proc, struct MMU_addr_space *as);
 void PROC_reschedule(void);
 void kexit(void);
 void yield(void);
@@ -64,5 +67,7 @@ void PROC_block_on(ProcessQueue queue, int enable_ints);
 void PROC_unblock_all(ProcessQueue queue);
 void PROC_unblock_head(ProcessQueue queue);
 void PROC_init_queue(ProcessQueue queue, Queue type);
+ProcessQueue PROC_create_queue(Queue type);
+void PROC_destroy_queue(ProcessQueue queue);
 
 #endif
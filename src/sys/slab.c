@@ -0,0 +1,653 @@
+/**
+ * @file
+ */
+#include "slab.h"
+#include "memory.h"
+#include "cpu.h"
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/string.h"
+#include "../drivers/interrupts.h"
+
+#define SLAB_MIN_OBJECTS 8 /* Slabs grow until this many objects fit. */
+#define SLAB_MAX_ORDER 3   /* ... or until they are 2^3 frames. */
+#define SLAB_MAX_EMPTY 1   /* Empty slabs a cache keeps for reuse. */
+#define SLAB_ALIGN 16
+#define SLAB_MAG_SIZE 32  /* Free objects held by each per-CPU magazine. */
+#define SLAB_MAG_BATCH 16 /* Objects moved per refill or drain. */
+#define SLAB_LINE 64      /* Cache line, magazines of two CPUs never share. */
+
+/** @brief Header at the start of every slab. */
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free;         /* Free objects, linked through their free word. */
+    unsigned int inuse; /* Objects allocated. */
+};
+
+#define SLAB_HEADER ((sizeof(struct slab) + SLAB_ALIGN - 1) & \
+    ~(SLAB_ALIGN - 1))
+
+/** @brief Per-CPU stack of free objects in front of the slab lists. */
+struct slab_magazine {
+    unsigned int count;
+    void *objs[SLAB_MAG_SIZE];
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills; /* Batches taken from the slab lists. */
+    uint64_t drains;  /* Batches given back to them. */
+} __attribute__((aligned(SLAB_LINE)));
+
+/** @brief Slabs of one object type.
+ *
+ * Objects are handed out from the magazine of the executing CPU, which only
+ * takes |lock| to move a batch from or to the slab lists. Batches come from
+ * |partial| first so that objects pack into as few slabs as possible.
+ */
+struct kmem_cache {
+    const char *name;
+    size_t size;          /* Object size asked for. */
+    size_t stride;        /* Distance between objects. */
+    size_t first;         /* Offset of the first object in a slab. */
+    size_t free_offset;   /* Where a free object keeps its freelist link. */
+    void (*ctor)(void *);
+    unsigned int order;   /* Each slab is 2^order frames. */
+    unsigned int objects; /* Objects per slab, 0 until set up. */
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    unsigned int num_empty;
+    uint64_t created;     /* TSC when the cache was set up. */
+    SLAB_stats stats;     /* Only |slabs| is kept here, under |lock|. */
+    struct kmem_cache *next; /* Every cache, for kmem_cache_dump(). */
+    spinlock_t lock;      /* Guards the slab lists. */
+    struct slab_magazine mags[MAX_CPUS]; /* Indexed by cpu_id(). */
+};
+
+/** @brief Object sizes, powers of two and the halfway points above 64. */
+static const size_t class_sizes[SLAB_NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 
+    3072, 4096
+};
+
+static const char *class_names[SLAB_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64", "kmalloc-96", 
+    "kmalloc-128", "kmalloc-192", "kmalloc-256", "kmalloc-384", 
+    "kmalloc-512", "kmalloc-768", "kmalloc-1024", "kmalloc-1536", 
+    "kmalloc-2048", "kmalloc-3072", "kmalloc-4096"
+};
+
+/** @brief The size classes of SLAB_alloc(). */
+static struct kmem_cache kmalloc_caches[SLAB_NUM_CLASSES];
+
+/** @brief The cache kmem_cache_create() takes caches from. */
+static struct kmem_cache cache_cache;
+
+/** @brief Every cache that has been set up. */
+static struct kmem_cache *cache_list;
+static spinlock_t cache_list_lock;
+
+/** @brief Returns the index of the smallest class that holds |size| bytes. */
+static int size_class(size_t size) {
+    int bit;
+
+    if (size <= 64)
+        return (size - 1) / SLAB_MIN_SIZE;
+
+    /* 2^bit < size <= 2^(bit + 1), split at 3 * 2^(bit - 1). */
+    bit = 63 - __builtin_clzll(size - 1);
+
+    return 4 + (bit - 6) * 2 + (size > 3ULL << (bit - 1));
+}
+
+static inline size_t align_up(size_t size, size_t align) {
+
+    return (size + align - 1) & ~(align - 1);
+}
+
+/** @brief Returns the object alignment of size class |class|.
+ *
+ * Power of two classes are aligned to their size, so kmalloc_aligned() can
+ * take them from the slabs. This is not free: past the header size, the
+ * header pushes the first object out to a whole slot, so each slab holds one
+ * object fewer. The 4096 class fits 7 objects in 8 frames, 12.5% waste.
+ */
+static inline size_t class_align(int class) {
+    size_t size = class_sizes[class];
+
+    return size & (size - 1) ? SLAB_ALIGN : size;
+}
+
+/** @brief Returns the freelist link of the free object |obj|. */
+static inline void **free_link(struct kmem_cache *cache, void *obj) {
+
+    return (void **) ((char *) obj + cache->free_offset);
+}
+
+static void slab_push(struct slab **head, struct slab *slab) {
+
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_remove(struct slab **head, struct slab *slab) {
+
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/** @brief Lays out the slabs of |cache| and adds it to |cache_list|.
+ *
+ * A cache with a constructor keeps the freelist link past the end of each
+ * object, so a free object stays constructed.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if an object does not fit a slab.
+ * @pre Interrupts are disabled and |cache_list_lock| is held.
+ */
+static int cache_setup(struct kmem_cache *cache, const char *name, 
+ size_t size, size_t align, void (*ctor)(void *)) {
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    memset(cache, 0, sizeof(struct kmem_cache));
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+    if (ctor) {
+        cache->free_offset = align_up(size, sizeof(void *));
+        cache->stride = align_up(cache->free_offset + sizeof(void *), align);
+    }
+    else
+        cache->stride = align_up(size < sizeof(void *) ? sizeof(void *) : 
+         size, align);
+    cache->first = align_up(SLAB_HEADER, align);
+
+    while (cache->order < SLAB_MAX_ORDER && ((PAGE_SIZE << cache->order) - 
+     cache->first) / cache->stride < SLAB_MIN_OBJECTS)
+        cache->order++;
+
+    if (cache->first + cache->stride > PAGE_SIZE << cache->order)
+        return EXIT_FAILURE;
+    cache->objects = ((PAGE_SIZE << cache->order) - cache->first) / 
+     cache->stride;
+
+    cache->created = rdtsc();
+    cache->next = cache_list;
+    cache_list = cache;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Points each frame of |slab| at |owner|, or clears them if NULL. */
+static void set_owner(struct slab *slab, struct slab *owner) {
+    MEM_page *page;
+    uint64_t frame = virt_to_phys(slab);
+    unsigned int i;
+
+    for (i = 0; i < 1U << slab->cache->order; i++, frame += PAGE_SIZE) {
+        page = MMU_pf_to_page((void *) frame);
+        page->owner = owner;
+        if (owner)
+            page->flags |= PG_SLAB;
+        else
+            page->flags &= ~PG_SLAB;
+    }
+}
+
+/** @brief Allocates a slab for |cache| with every object on its freelist.
+ *
+ * Runs the constructor of the cache on each object.
+ * @returns The slab, or NULL if there are no free frames.
+ */
+static struct slab *slab_create(struct kmem_cache *cache) {
+    struct slab *slab;
+    void *frames;
+    char *obj;
+    unsigned int i;
+
+    frames = MMU_pf_alloc_order(cache->order);
+    if (!frames)
+        return NULL;
+
+    slab = phys_to_virt((uint64_t) frames);
+    slab->cache = cache;
+    slab->inuse = 0;
+    set_owner(slab, slab);
+
+    /* Link the objects in ascending order. */
+    obj = (char *) slab + cache->first;
+    slab->free = obj;
+    for (i = 0; i < cache->objects; i++, obj += cache->stride) {
+        if (cache->ctor)
+            cache->ctor(obj);
+        *free_link(cache, obj) = i + 1 < cache->objects ?
+         obj + cache->stride : NULL;
+    }
+
+    cache->stats.slabs++;
+
+    return slab;
+}
+
+/** @brief Returns the frames of an empty slab. */
+static void slab_destroy(struct slab *slab) {
+    struct kmem_cache *cache = slab->cache;
+
+    set_owner(slab, NULL);
+    MMU_pf_free_order((void *) virt_to_phys(slab), cache->order);
+    cache->stats.slabs--;
+}
+
+/** @brief Returns the slab |ptr| was allocated from, or NULL. */
+static struct slab *find_slab(void *ptr) {
+    MEM_page *page;
+
+    if ((uint64_t) ptr < DMAP_ADDR)
+        return NULL;
+
+    page = MMU_pf_to_page((void *) virt_to_phys(ptr));
+    if (!page || !(page->flags & PG_SLAB))
+        return NULL;
+
+    return page->owner;
+}
+
+/** @brief Takes an object from the slabs of |cache|.
+ *
+ * @pre Interrupts are disabled and |cache->lock| is held.
+ */
+static void *cache_alloc(struct kmem_cache *cache) {
+    struct slab *slab;
+    void *obj;
+
+    slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_remove(&cache->empty, slab);
+            cache->num_empty--;
+        }
+        else
+            slab = slab_create(cache);
+
+        if (!slab)
+            return NULL;
+        slab_push(&cache->partial, slab);
+    }
+
+    obj = slab->free;
+    slab->free = *free_link(cache, obj);
+    if (++slab->inuse == cache->objects) {
+        slab_remove(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+/** @brief Returns |obj| to |slab|.
+ *
+ * A slab left empty is kept for reuse if its cache has fewer than
+ * SLAB_MAX_EMPTY empty slabs, and returned to the page frame allocator
+ * otherwise.
+ * @pre Interrupts are disabled and |cache->lock| is held.
+ */
+static void cache_free(struct slab *slab, void *obj) {
+    struct kmem_cache *cache = slab->cache;
+
+    if (slab->inuse-- == cache->objects) {
+        slab_remove(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    *free_link(cache, obj) = slab->free;
+    slab->free = obj;
+
+    if (!slab->inuse) {
+        slab_remove(&cache->partial, slab);
+        if (cache->num_empty < SLAB_MAX_EMPTY) {
+            slab_push(&cache->empty, slab);
+            cache->num_empty++;
+        }
+        else
+            slab_destroy(slab);
+    }
+}
+
+/** @brief Returns objects from |mag| to their slabs until |keep| are left.
+ *
+ * @pre Interrupts are disabled and |cache->lock| is held.
+ */
+static void mag_drain(struct kmem_cache *cache, struct slab_magazine *mag, 
+ unsigned int keep) {
+    void *obj;
+
+    while (mag->count > keep) {
+        obj = mag->objs[--mag->count];
+        cache_free(find_slab(obj), obj);
+    }
+}
+
+/** @brief Takes an object from the magazine of the executing CPU.
+ *
+ * An empty magazine is refilled with SLAB_MAG_BATCH objects first, so
+ * |cache->lock| is only taken once per batch.
+ * @returns The object, or NULL if no frames are free.
+ * @pre Interrupts are disabled.
+ */
+static void *mag_alloc(struct kmem_cache *cache) {
+    struct slab_magazine *mag = &cache->mags[cpu_id()];
+    void *obj;
+
+    if (!mag->count) {
+        mag->refills++;
+
+        spin_lock(&cache->lock);
+        while (mag->count < SLAB_MAG_BATCH && (obj = cache_alloc(cache)))
+            mag->objs[mag->count++] = obj;
+        spin_unlock(&cache->lock);
+
+        if (!mag->count)
+            return NULL;
+    }
+
+    mag->allocs++;
+
+    return mag->objs[--mag->count];
+}
+
+/** @brief Puts |obj| in the magazine of the executing CPU.
+ *
+ * A full magazine drains SLAB_MAG_BATCH objects back to the slabs first.
+ * @pre Interrupts are disabled.
+ */
+static void mag_free(struct kmem_cache *cache, void *obj) {
+    struct slab_magazine *mag = &cache->mags[cpu_id()];
+
+    if (mag->count == SLAB_MAG_SIZE) {
+        mag->drains++;
+
+        spin_lock(&cache->lock);
+        mag_drain(cache, mag, SLAB_MAG_SIZE - SLAB_MAG_BATCH);
+        spin_unlock(&cache->lock);
+    }
+
+    mag->objs[mag->count++] = obj;
+    mag->frees++;
+}
+
+/** @brief Returns the objects of |cache| that are allocated. */
+static uint64_t cache_active(struct kmem_cache *cache) {
+    uint64_t active = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        active += cache->mags[cpu].allocs - cache->mags[cpu].frees;
+
+    return active;
+}
+
+/** @brief Creates a cache of objects of one type.
+ *
+ * @param name shown by kmem_cache_dump(), must outlive the cache.
+ * @param size the object size in bytes.
+ * @param align the object alignment, a power of two, or 0 for pointer
+ * alignment.
+ * @param ctor called on each object when its slab is created, or NULL.
+ * Objects must be in their constructed state when they are freed.
+ * @returns The cache, or NULL if an object does not fit in a slab or memory
+ * ran out.
+ * @pre MMU_init() has set up the direct map.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, 
+ size_t align, void (*ctor)(void *)) {
+    struct kmem_cache *cache = NULL;
+    int ints_enabled = 0;
+
+    if (!size || align & (align - 1))
+        return NULL;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    spin_lock(&cache_list_lock);
+    if (!cache_cache.objects)
+        cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 
+         __alignof__(struct kmem_cache), NULL);
+
+    cache = mag_alloc(&cache_cache);
+    if (cache && cache_setup(cache, name, size, align, ctor) != EXIT_SUCCESS) {
+        mag_free(&cache_cache, cache);
+        cache = NULL;
+    }
+    spin_unlock(&cache_list_lock);
+
+    if (ints_enabled)
+        STI;
+
+    return cache;
+}
+
+/** @brief Destroys a cache from kmem_cache_create().
+ *
+ * Empties the magazines of every CPU, which must no longer use the cache.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if it still has objects allocated.
+ */
+int kmem_cache_destroy(struct kmem_cache *cache) {
+    struct kmem_cache **prev;
+    struct slab *slab;
+    uint64_t active = cache_active(cache);
+    int cpu, ints_enabled = 0;
+
+    if (active) {
+        printk("kmem_cache_destroy: %s still has %lu objects\n", cache->name, 
+         (unsigned long) active);
+        return EXIT_FAILURE;
+    }
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    spin_lock(&cache->lock);
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        mag_drain(cache, &cache->mags[cpu], 0);
+    while ((slab = cache->empty)) {
+        slab_remove(&cache->empty, slab);
+        slab_destroy(slab);
+    }
+    spin_unlock(&cache->lock);
+
+    spin_lock(&cache_list_lock);
+    for (prev = &cache_list; *prev != cache; prev = &(*prev)->next)
+        ;
+    *prev = cache->next;
+    mag_free(&cache_cache, cache);
+    spin_unlock(&cache_list_lock);
+
+    if (ints_enabled)
+        STI;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Allocates a constructed object from |cache|.
+ *
+ * @returns The object, or NULL if no frames are free.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    void *obj;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    obj = mag_alloc(cache);
+
+    if (ints_enabled)
+        STI;
+
+    return obj;
+}
+
+/** @brief Returns |obj| to |cache|.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |obj| is not from |cache|.
+ */
+int kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    struct slab *slab = find_slab(obj);
+    int ints_enabled = 0;
+
+    if (!slab || slab->cache != cache)
+        return EXIT_FAILURE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    mag_free(cache, obj);
+
+    if (ints_enabled)
+        STI;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Copies the counters of |cache|, summed over every CPU, into
+ * |stats|.
+ */
+void kmem_cache_stats(struct kmem_cache *cache, SLAB_stats *stats) {
+    uint64_t cycles = rdtsc() - cache->created;
+    struct slab_magazine *mag;
+    int cpu;
+
+    memcpy(stats, &cache->stats, sizeof(SLAB_stats));
+    stats->name = cache->name;
+    stats->size = cache->size;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        mag = &cache->mags[cpu];
+        stats->allocs += mag->allocs;
+        stats->frees += mag->frees;
+        stats->refills += mag->refills;
+        stats->drains += mag->drains;
+    }
+    stats->active = stats->allocs - stats->frees;
+    stats->rate = cycles ? stats->allocs * 1000000 / cycles : 0;
+}
+
+/** @brief Prints the counters of every cache in use. */
+void kmem_cache_dump(void) {
+    struct kmem_cache *cache;
+    SLAB_stats stats;
+
+    for (cache = cache_list; cache; cache = cache->next) {
+        kmem_cache_stats(cache, &stats);
+        printk("%s: size %lu active %lu slabs %lu, %lu allocs/Mcycle, " 
+         "%lu refills %lu drains\n", stats.name, (unsigned long) stats.size, 
+         (unsigned long) stats.active, (unsigned long) stats.slabs, 
+         (unsigned long) stats.rate, (unsigned long) stats.refills, 
+         (unsigned long) stats.drains);
+    }
+}
+
+/** @brief Allocates an object of at least |size| bytes from the size class
+ * caches.
+ *
+ * @returns A SLAB_ALIGN aligned pointer, or NULL if |size| is 0, larger than
+ * SLAB_MAX_SIZE or no frames are free. Sizes that are a power of two get
+ * objects aligned to their size.
+ * @pre MMU_init() has set up the direct map.
+ */
+void *SLAB_alloc(size_t size) {
+    struct kmem_cache *cache;
+    void *obj;
+    int class, ints_enabled = 0;
+
+    if (!size || size > SLAB_MAX_SIZE)
+        return NULL;
+
+    class = size_class(size);
+    cache = &kmalloc_caches[class];
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    if (!cache->objects) {
+        spin_lock(&cache_list_lock);
+        if (!cache->objects)
+            cache_setup(cache, class_names[class], class_sizes[class], 
+             class_align(class), NULL);
+        spin_unlock(&cache_list_lock);
+    }
+    obj = mag_alloc(cache);
+
+    if (ints_enabled)
+        STI;
+
+    return obj;
+}
+
+/** @brief Frees an object from any cache.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |ptr| is not a slab object.
+ */
+int SLAB_free(void *ptr) {
+    struct slab *slab = find_slab(ptr);
+    int ints_enabled = 0;
+
+    if (!slab)
+        return EXIT_FAILURE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    mag_free(slab->cache, ptr);
+
+    if (ints_enabled)
+        STI;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Returns the usable size of slab object |ptr|, or 0 if it is not
+ * one.
+ */
+size_t SLAB_size(void *ptr) {
+    struct slab *slab = find_slab(ptr);
+
+    return slab ? slab->cache->size : 0;
+}
+
+/** @brief Copies the counters of size class |class| into |stats|.
+ *
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if there is no such class.
+ */
+int SLAB_get_stats(int class, SLAB_stats *stats) {
+
+    if (class < 0 || class >= SLAB_NUM_CLASSES)
+        return EXIT_FAILURE;
+
+    kmem_cache_stats(&kmalloc_caches[class], stats);
+    stats->name = class_names[class];
+    stats->size = class_sizes[class];
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include "../lib/stdint.h"
+
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 4096 /* Larger requests go to the page allocator. */
+#define SLAB_NUM_CLASSES 16
+
+struct kmem_cache;
+
+/** @brief Counters of one cache. */
+typedef struct {
+    const char *name;
+    uint64_t size;    /* Object size. */
+    uint64_t active;  /* Objects allocated. */
+    uint64_t slabs;   /* Slabs held, including empty ones. */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills; /* Batches the per-CPU magazines took from the slabs. */
+    uint64_t drains;  /* Batches they gave back. */
+    uint64_t rate;    /* Allocations per million cycles since creation. */
+} SLAB_stats;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, 
+ size_t align, void (*ctor)(void *));
+int kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+int kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_stats(struct kmem_cache *cache, SLAB_stats *stats);
+void kmem_cache_dump(void);
+
+void *SLAB_alloc(size_t size);
+int SLAB_free(void *ptr);
+size_t SLAB_size(void *ptr);
+int SLAB_get_stats(int class, SLAB_stats *stats);
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * @file
+ */
+#include "tlb.h"
+#include "cpu.h"
+#include "../lib/string.h"
+#include "../drivers/interrupts.h"
+
+/** @brief Set when CR4.PCIDE has been enabled. */
+static int pcid_enabled;
+
+/** @brief Bitmap of PCIDs in use. PCID 0 belongs to the kernel. */
+static uint64_t pcid_map[NUM_PCIDS / 64];
+
+/** @brief Initializes TLB management.
+ *
+ * Enables global pages so kernel translations survive CR3 loads, and PCIDs 
+ * when CPUID reports them so address spaces keep their TLB entries across
+ * switches.
+ * @pre CR3 holds a PML4 with PCID 0 in its low bits.
+ * @post Global pages are enabled and PCIDs are enabled if supported.
+ */
+void TLB_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t cr4;
+
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    cr4 = read_cr4();
+
+    if (edx & CPUID_PGE)
+        cr4 |= CR4_PGE;
+
+    if (ecx & CPUID_PCID) {
+        cr4 |= CR4_PCIDE;
+        pcid_enabled = 1;
+    }
+
+    write_cr4(cr4);
+
+    memset(pcid_map, 0, sizeof(pcid_map));
+    pcid_map[0] = 1ULL << KERNEL_PCID;
+}
+
+/** @brief Invalidates the translation of one page, including global ones. */
+void TLB_flush_page(void *addr) {
+
+    asm volatile ( "invlpg (%0)" : : "r"(addr) : "memory" );
+}
+
+/** @brief Invalidates every translation, including global ones.
+ *
+ * Toggling CR4.PGE flushes global entries, which a CR3 load keeps.
+ */
+void TLB_flush_all(void) {
+    uint64_t cr4 = read_cr4();
+
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    }
+    else
+        write_cr3(read_cr3());
+}
+
+void TLB_gather_init(TLB_gather *gather) {
+
+    gather->count = 0;
+    gather->flush_all = 0;
+}
+
+/** @brief Queues |addr| to be invalidated by TLB_gather_flush(). */
+void TLB_gather_add(TLB_gather *gather, void *addr) {
+
+    if (gather->flush_all)
+        return;
+
+    if (gather->count == TLB_FLUSH_CEILING)
+        gather->flush_all = 1;
+    else
+        gather->addrs[gather->count++] = (uint64_t) addr;
+}
+
+/** @brief Invalidates every page queued in |gather|.
+ *
+ * Uses one invlpg per page, or a single full flush once the batch grew past 
+ * TLB_FLUSH_CEILING pages, where refilling the TLB is cheaper.
+ * @post |gather| is empty.
+ */
+void TLB_gather_flush(TLB_gather *gather) {
+    unsigned int i;
+
+    if (gather->flush_all)
+        TLB_flush_all();
+    else
+        for (i = 0; i < gather->count; i++)
+            TLB_flush_page((void *) gather->addrs[i]);
+
+    TLB_gather_init(gather);
+}
+
+int TLB_pcid_enabled(void) {
+
+    return pcid_enabled;
+}
+
+/** @brief Reserves a PCID for an address space.
+ *
+ * @returns A free PCID, or KERNEL_PCID if PCIDs are unsupported or all in 
+ * use, in which case the caller must flush on every switch.
+ */
+uint16_t TLB_alloc_pcid(void) {
+    int i, ints_enabled = 0;
+    uint16_t ret = KERNEL_PCID;
+
+    if (!pcid_enabled)
+        return ret;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    for (i = 0; i < NUM_PCIDS / 64; i++) {
+        if (~pcid_map[i]) {
+            ret = i * 64 + __builtin_ctzll(~pcid_map[i]);
+            pcid_map[i] |= 1ULL << (ret % 64);
+            break;
+        }
+    }
+
+    if (ints_enabled)
+        STI;
+
+    return ret;
+}
+
+void TLB_free_pcid(uint16_t pcid) {
+
+    if (pcid != KERNEL_PCID && pcid < NUM_PCIDS)
+        pcid_map[pcid / 64] &= ~(1ULL << (pcid % 64));
+}
+
+/** @brief Builds a CR3 value.
+ *
+ * @param pml4 physical address of the PML4.
+ * @param noflush keep the TLB entries tagged with |pcid| when loading it.
+ */
+uint64_t TLB_make_cr3(uint64_t pml4, uint16_t pcid, int noflush) {
+    uint64_t cr3 = pml4;
+
+    if (pcid_enabled) {
+        cr3 |= pcid;
+        if (noflush)
+            cr3 |= CR3_NOFLUSH;
+    }
+
+    return cr3;
+}
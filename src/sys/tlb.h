@@ -0,0 +1,34 @@
+#ifndef _TLB_H
+#define _TLB_H
+
+#include "../lib/stdint.h"
+
+#define CR4_PGE (1ULL << 7)    /* Global pages. */
+#define CR4_PCIDE (1ULL << 17) /* Process-context identifiers. */
+#define CR3_NOFLUSH (1ULL << 63) /* Keep the PCID's entries on CR3 load. */
+
+#define NUM_PCIDS 4096
+#define KERNEL_PCID 0
+
+/* Pages a gather flushes one by one before falling back to a full flush. */
+#define TLB_FLUSH_CEILING 33
+
+/** @brief Batch of pages to invalidate after a range is unmapped. */
+typedef struct {
+    uint64_t addrs[TLB_FLUSH_CEILING];
+    unsigned int count;
+    int flush_all; /* Set once more than TLB_FLUSH_CEILING pages are added. */
+} TLB_gather;
+
+void TLB_init(void);
+void TLB_flush_page(void *addr);
+void TLB_flush_all(void);
+void TLB_gather_init(TLB_gather *gather);
+void TLB_gather_add(TLB_gather *gather, void *addr);
+void TLB_gather_flush(TLB_gather *gather);
+int TLB_pcid_enabled(void);
+uint16_t TLB_alloc_pcid(void);
+void TLB_free_pcid(uint16_t pcid);
+uint64_t TLB_make_cr3(uint64_t pml4, uint16_t pcid, int noflush);
+
+#endif
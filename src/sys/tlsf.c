@@ -0,0 +1,522 @@
+/**
+ * @file
+ */
+#include "tlsf.h"
+#include "memory.h"
+#include "cpu.h"
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/string.h"
+#include "../lib/debug.h"
+#include "../drivers/interrupts.h"
+
+/* Free blocks are kept on one of FL_COUNT * SL_COUNT lists. The first level
+ * is the power of two below the size and the second level splits it into
+ * SL_COUNT equal parts. Two levels of bitmaps record which lists have blocks,
+ * so finding one takes two bit scans however fragmented the heap is.
+ */
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 4)         /* Sizes below 2^8 share level 0. */
+#define SMALL_BLOCK (1UL << FL_SHIFT)
+#define FL_COUNT (32 - FL_SHIFT + 1)   /* Blocks of 2^32 and up share one. */
+#define TLSF_TRIM_SIZE (4 * TLSF_GROW_SIZE) /* Free tail that is trimmed. */
+
+#define BLOCK_FREE 0x1 /* Kept in the low bit of the size. */
+
+/** @brief Header of a block. The links are only there while it is free. */
+typedef struct tlsf_block {
+    struct tlsf_block *prev_phys; /* Block before this one, or NULL. */
+    size_t size;                  /* Payload bytes and BLOCK_FREE. */
+    struct tlsf_block *next_free;
+    struct tlsf_block *prev_free;
+} tlsf_block;
+
+#define BLOCK_HEADER offsetof(tlsf_block, next_free)
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+static tlsf_block *free_lists[FL_COUNT][SL_COUNT];
+
+/** @brief Used block of size 0 that ends the last region of the heap. */
+static tlsf_block *heap_end;
+
+static TLSF_stats stats;
+static uint64_t reserved; /* Bytes TLSF_reserve() set aside. */
+static spinlock_t tlsf_lock;
+
+static inline size_t align_up(size_t size, size_t align) {
+
+    return (size + align - 1) & ~(align - 1);
+}
+
+static inline size_t block_size(tlsf_block *block) {
+
+    return block->size & ~(size_t) BLOCK_FREE;
+}
+
+static inline void set_size(tlsf_block *block, size_t size) {
+
+    block->size = size | (block->size & BLOCK_FREE);
+}
+
+static inline tlsf_block *block_next(tlsf_block *block) {
+
+    return (tlsf_block *) ((char *) block + BLOCK_HEADER + block_size(block));
+}
+
+/** @brief Returns the list a block of |size| bytes belongs on. */
+static void mapping(size_t size, int *fl, int *sl) {
+    int bit;
+
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+        return;
+    }
+
+    bit = 63 - __builtin_clzll(size);
+    if (bit >= 32) {
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+        return;
+    }
+
+    *fl = bit - FL_SHIFT + 1;
+    *sl = (size >> (bit - SL_LOG2)) & (SL_COUNT - 1);
+}
+
+/** @brief Rounds |size| up so that every block on its list is large enough. */
+static size_t search_size(size_t size) {
+
+    if (size >= SMALL_BLOCK)
+        size += (1UL << (63 - __builtin_clzll(size) - SL_LOG2)) - 1;
+
+    return size;
+}
+
+static void insert_block(tlsf_block *block) {
+    int fl, sl;
+
+    mapping(block_size(block), &fl, &sl);
+    block->size |= BLOCK_FREE;
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free)
+        block->next_free->prev_free = block;
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    stats.free += block_size(block);
+    stats.blocks++;
+}
+
+static void remove_block(tlsf_block *block) {
+    int fl, sl;
+
+    mapping(block_size(block), &fl, &sl);
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        free_lists[fl][sl] = block->next_free;
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl])
+            fl_bitmap &= ~(1U << fl);
+    }
+
+    block->size &= ~(size_t) BLOCK_FREE;
+    stats.free -= block_size(block);
+    stats.blocks--;
+}
+
+/** @brief Returns a free block of at least |size| bytes, or NULL. */
+static tlsf_block *find_block(size_t size) {
+    uint32_t map;
+    int fl, sl;
+
+    mapping(search_size(size), &fl, &sl);
+
+    map = sl_bitmap[fl] & (~0U << sl);
+    if (!map) {
+        /* Any block on a higher first level list is large enough. */
+        if (fl == FL_COUNT - 1)
+            return NULL;
+        map = fl_bitmap & (~0U << (fl + 1));
+        if (!map)
+            return NULL;
+
+        fl = __builtin_ctz(map);
+        map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(map);
+
+    return free_lists[fl][sl];
+}
+
+/** @brief Absorbs the block after |block| if it is free. */
+static tlsf_block *merge_next(tlsf_block *block) {
+    tlsf_block *next = block_next(block);
+
+    if (next->size & BLOCK_FREE) {
+        remove_block(next);
+        set_size(block, block_size(block) + BLOCK_HEADER + block_size(next));
+        block_next(block)->prev_phys = block;
+    }
+
+    return block;
+}
+
+/** @brief Merges |block| into the block before it if that is free. */
+static tlsf_block *merge_prev(tlsf_block *block) {
+    tlsf_block *prev = block->prev_phys;
+
+    if (prev && prev->size & BLOCK_FREE) {
+        remove_block(prev);
+        set_size(prev, block_size(prev) + BLOCK_HEADER + block_size(block));
+        block_next(prev)->prev_phys = prev;
+        block = prev;
+    }
+
+    return block;
+}
+
+/** @brief Frees the part of |block| past its first |size| bytes if it can
+ * hold a free block.
+ */
+static void trim(tlsf_block *block, size_t size) {
+    tlsf_block *rest;
+    size_t left = block_size(block);
+
+    if (left < size + sizeof(tlsf_block))
+        return;
+
+    set_size(block, size);
+    rest = block_next(block);
+    rest->prev_phys = block;
+    rest->size = left - size - BLOCK_HEADER;
+    block_next(rest)->prev_phys = rest;
+    insert_block(merge_next(rest));
+}
+
+/** @brief Extends the heap by enough for a |size| byte block.
+ *
+ * Memory that does not follow |heap_end| starts a new region.
+ * @returns The new block, merged with a free block before it and not on a
+ * free list, or NULL if kbrk() fails.
+ */
+static tlsf_block *grow_heap(size_t size) {
+    tlsf_block *block;
+    size_t grow;
+    char *brk;
+
+    grow = size + 2 * BLOCK_HEADER;
+    if (grow < TLSF_GROW_SIZE)
+        grow = TLSF_GROW_SIZE;
+    grow = align_up(grow, PAGE_SIZE); /* kbrk() hands out whole pages. */
+
+    brk = kbrk(grow);
+    if (brk == (void *) -1)
+        return NULL;
+    stats.heap += grow;
+
+    if (heap_end && brk == (char *) heap_end + BLOCK_HEADER) {
+        block = heap_end; /* Keeps |prev_phys|. */
+        block->size = grow - BLOCK_HEADER;
+    }
+    else {
+        block = (tlsf_block *) brk;
+        block->prev_phys = NULL;
+        block->size = grow - 2 * BLOCK_HEADER;
+    }
+
+    heap_end = block_next(block);
+    heap_end->prev_phys = block;
+    heap_end->size = 0;
+
+    return merge_prev(block);
+}
+
+/** @brief Gives the pages at the end of the heap back to kbrk() once the free
+ * |block| before |heap_end| is larger than TLSF_TRIM_SIZE.
+ *
+ * TLSF_GROW_SIZE bytes, or all TLSF_reserve() set aside if more, stay free,
+ * so a heap that shrank does not grow again on the next allocation.
+ */
+static void trim_heap(tlsf_block *block) {
+    size_t release, keep = reserved > TLSF_GROW_SIZE ? reserved : 
+     TLSF_GROW_SIZE;
+
+    if (block_size(block) <= TLSF_TRIM_SIZE || block_size(block) <= keep || 
+     kbrk(0) != (char *) heap_end + BLOCK_HEADER)
+        return;
+
+    release = (block_size(block) - keep) & ~(PAGE_SIZE - 1);
+    if (!release)
+        return;
+    set_size(block, block_size(block) - release);
+    heap_end = block_next(block);
+    heap_end->prev_phys = block;
+    heap_end->size = 0;
+
+    if (kbrk(-release) != (void *) -1)
+        stats.heap -= release;
+}
+
+/** @brief Allocates |size| bytes in constant time.
+ *
+ * Only growing the heap is unbounded, see TLSF_reserve().
+ * @returns A TLSF_ALIGN aligned pointer, or NULL if |size| is 0 or larger than
+ * TLSF_MAX_SIZE, or the heap cannot grow.
+ */
+void *TLSF_alloc(size_t size) {
+    tlsf_block *block;
+    int ints_enabled = 0;
+
+    if (!size || size > TLSF_MAX_SIZE)
+        return NULL;
+    size = align_up(size, TLSF_ALIGN);
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    block = find_block(size);
+    if (block)
+        remove_block(block);
+    else
+        block = grow_heap(size);
+
+    if (block) {
+        trim(block, size);
+        stats.used += block_size(block);
+    }
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+
+    return block ? (char *) block + BLOCK_HEADER : NULL;
+}
+
+/** @brief Allocates |size| bytes at a multiple of |align|.
+ *
+ * Takes a block with room to spare and frees the space in front of the
+ * aligned address as a block of its own.
+ * @param align a power of two.
+ * @returns The aligned pointer, which TLSF_free() accepts, or NULL.
+ */
+void *TLSF_alloc_aligned(size_t size, size_t align) {
+    tlsf_block *block, *next;
+    uint64_t ptr;
+    size_t gap;
+    int ints_enabled = 0;
+
+    if (align <= TLSF_ALIGN)
+        return TLSF_alloc(size);
+    if (!size || size > TLSF_MAX_SIZE || align > TLSF_MAX_SIZE / 2)
+        return NULL;
+    size = align_up(size, TLSF_ALIGN);
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    /* A gap too small for a free block is widened by |align|. */
+    block = find_block(size + align + sizeof(tlsf_block));
+    if (block)
+        remove_block(block);
+    else
+        block = grow_heap(size + align + sizeof(tlsf_block));
+
+    if (block) {
+        ptr = (uint64_t) block + BLOCK_HEADER;
+        gap = align_up(ptr, align) - ptr;
+        if (gap && gap < sizeof(tlsf_block))
+            gap += align;
+
+        if (gap) {
+            next = (tlsf_block *) ((char *) block + gap);
+            next->prev_phys = block;
+            next->size = block_size(block) - gap;
+            block_next(next)->prev_phys = next;
+            set_size(block, gap - BLOCK_HEADER);
+            insert_block(block);
+            block = next;
+        }
+
+        trim(block, size);
+        stats.used += block_size(block);
+    }
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+
+    return block ? (char *) block + BLOCK_HEADER : NULL;
+}
+
+/** @brief Frees |ptr| in constant time, merging it with free neighbours.
+ *
+ * The heap never shrinks here, so freeing in interrupt context stays cheap
+ * and keeps what TLSF_reserve() set aside, see TLSF_trim().
+ */
+void TLSF_free(void *ptr) {
+    tlsf_block *block = (tlsf_block *) ((char *) ptr - BLOCK_HEADER);
+    int ints_enabled = 0;
+
+    if (block->size & BLOCK_FREE) {
+        printk("TLSF_free: %p is already free\n", ptr);
+        HALT_CPU
+    }
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    stats.used -= block_size(block);
+    insert_block(merge_prev(merge_next(block)));
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+}
+
+/** @brief Resizes |ptr| in place if it shrinks or the block after it is free
+ * and large enough, and moves it otherwise.
+ *
+ * @returns The block, or NULL if it had to move and no memory is left.
+ * @pre |ptr| is from TLSF_alloc() and |size| is not 0.
+ */
+void *TLSF_realloc(void *ptr, size_t size) {
+    tlsf_block *block = (tlsf_block *) ((char *) ptr - BLOCK_HEADER), *next;
+    size_t old_size = block_size(block);
+    int ints_enabled = 0;
+    void *ret;
+
+    if (size > TLSF_MAX_SIZE)
+        return NULL;
+    size = align_up(size, TLSF_ALIGN);
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    next = block_next(block);
+    if (size > old_size && (!(next->size & BLOCK_FREE) || 
+     old_size + BLOCK_HEADER + block_size(next) < size)) {
+        spin_unlock(&tlsf_lock);
+        if (ints_enabled)
+            STI;
+
+        ret = TLSF_alloc(size);
+        if (ret) {
+            memcpy(ret, ptr, old_size);
+            TLSF_free(ptr);
+        }
+        return ret;
+    }
+
+    merge_next(block);
+    trim(block, size);
+    stats.used += block_size(block) - old_size;
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+
+    return ptr;
+}
+
+/** @brief Returns the usable size of |ptr|. */
+size_t TLSF_size(void *ptr) {
+
+    return block_size((tlsf_block *) ((char *) ptr - BLOCK_HEADER));
+}
+
+/** @brief Grows the heap by a free block of at least |size| bytes.
+ *
+ * Code that allocates in interrupt context reserves what it needs up front,
+ * so that TLSF_alloc() does not have to call kbrk() there.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if kbrk() fails.
+ */
+int TLSF_reserve(size_t size) {
+    tlsf_block *block;
+    int ints_enabled = 0;
+
+    if (size > TLSF_MAX_SIZE)
+        return EXIT_FAILURE;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    block = grow_heap(align_up(size, TLSF_ALIGN));
+    if (block) {
+        insert_block(block);
+        reserved += size;
+    }
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+
+    return block ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/** @brief Gives free memory at the end of the heap back to kbrk().
+ *
+ * Unmapping the pages takes time proportional to their number and a TLB
+ * flush, so this is left to thread context rather than done by TLSF_free().
+ */
+void TLSF_trim(void) {
+    tlsf_block *block;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    block = heap_end ? heap_end->prev_phys : NULL;
+    if (block && block->size & BLOCK_FREE) {
+        remove_block(block);
+        trim_heap(block);
+        insert_block(block);
+    }
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+}
+
+void TLSF_get_stats(TLSF_stats *stats_out) {
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+    spin_lock(&tlsf_lock);
+
+    memcpy(stats_out, &stats, sizeof(TLSF_stats));
+
+    spin_unlock(&tlsf_lock);
+    if (ints_enabled)
+        STI;
+}
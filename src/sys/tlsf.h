@@ -0,0 +1,28 @@
+#ifndef _TLSF_H
+#define _TLSF_H
+
+#include <stddef.h>
+#include "../lib/stdint.h"
+
+#define TLSF_ALIGN 16
+#define TLSF_MAX_SIZE (1UL << 31) /* Largest allocation. */
+#define TLSF_GROW_SIZE 0x40000    /* Least kbrk() is asked for, and kept. */
+
+/** @brief Counters of the TLSF heap. */
+typedef struct {
+    uint64_t heap;   /* Bytes taken from kbrk(). */
+    uint64_t used;   /* Payload bytes allocated. */
+    uint64_t free;   /* Payload bytes on the free lists. */
+    uint64_t blocks; /* Free blocks. */
+} TLSF_stats;
+
+void *TLSF_alloc(size_t size);
+void *TLSF_alloc_aligned(size_t size, size_t align);
+void TLSF_free(void *ptr);
+void *TLSF_realloc(void *ptr, size_t size);
+size_t TLSF_size(void *ptr);
+int TLSF_reserve(size_t size);
+void TLSF_trim(void);
+void TLSF_get_stats(TLSF_stats *stats);
+
+#endif
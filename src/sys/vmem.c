@@ -0,0 +1,377 @@
+/**
+ * @file
+ */
+#include "vmem.h"
+#include "memory.h"
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/string.h"
+#include "../drivers/interrupts.h"
+#include <stddef.h>
+
+/** @brief Unused boundary tags, shared by all arenas. */
+static VMEM_seg *seg_pool;
+
+/** @brief Takes a boundary tag from the pool, refilling it with a frame. */
+static VMEM_seg *seg_get(void) {
+    VMEM_seg *seg;
+    unsigned int i;
+
+    if (!seg_pool) {
+        seg = MMU_pf_alloc();
+        if (!seg)
+            return NULL;
+        seg = phys_to_virt((uint64_t) seg);
+
+        for (i = 0; i < PAGE_SIZE / sizeof(VMEM_seg); i++) {
+            seg[i].list_next = seg_pool;
+            seg_pool = &seg[i];
+        }
+    }
+
+    seg = seg_pool;
+    seg_pool = seg->list_next;
+
+    return seg;
+}
+
+static void seg_put(VMEM_seg *seg) {
+
+    seg->list_next = seg_pool;
+    seg_pool = seg;
+}
+
+/** @brief Returns n such that 2^n <= |size| < 2^(n + 1). */
+static inline int highbit(uint64_t size) {
+
+    return 63 - __builtin_clzll(size);
+}
+
+static inline unsigned int hash_index(uint64_t addr) {
+
+    return ((addr >> 12) ^ (addr >> 21)) % VMEM_HASH_SIZE;
+}
+
+/** @brief Pushes |seg| onto a list and links it both ways. */
+static void list_push(VMEM_seg **head, VMEM_seg *seg) {
+
+    seg->list_prev = NULL;
+    seg->list_next = *head;
+    if (*head)
+        (*head)->list_prev = seg;
+    *head = seg;
+}
+
+static void list_remove(VMEM_seg **head, VMEM_seg *seg) {
+
+    if (seg->list_prev)
+        seg->list_prev->list_next = seg->list_next;
+    else
+        *head = seg->list_next;
+
+    if (seg->list_next)
+        seg->list_next->list_prev = seg->list_prev;
+}
+
+static void freelist_insert(VMEM_arena *arena, VMEM_seg *seg) {
+    int index = highbit(seg->size);
+
+    seg->free = 1;
+    list_push(&arena->freelists[index], seg);
+    arena->freemap |= 1ULL << index;
+}
+
+static void freelist_remove(VMEM_arena *arena, VMEM_seg *seg) {
+    int index = highbit(seg->size);
+
+    list_remove(&arena->freelists[index], seg);
+    if (!arena->freelists[index])
+        arena->freemap &= ~(1ULL << index);
+}
+
+/** @brief Unlinks |seg| from the address ordered list and frees the tag. */
+static void seg_unlink(VMEM_arena *arena, VMEM_seg *seg) {
+
+    if (seg->seg_prev)
+        seg->seg_prev->seg_next = seg->seg_next;
+    else
+        arena->segs = seg->seg_next;
+
+    if (seg->seg_next)
+        seg->seg_next->seg_prev = seg->seg_prev;
+
+    seg_put(seg);
+}
+
+/** @brief Initializes an arena spanning [base, base + size).
+ *
+ * @param quantum allocation granularity; a power of two.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if no boundary tag is available.
+ */
+int VMEM_init(VMEM_arena *arena, const char *name, uint64_t base, 
+ uint64_t size, uint64_t quantum) {
+    VMEM_seg *seg;
+
+    memset(arena, 0, sizeof(VMEM_arena));
+    arena->name = name;
+    arena->base = base;
+    arena->size = size - size % quantum;
+    arena->quantum = quantum;
+
+    seg = seg_get();
+    if (!seg)
+        return EXIT_FAILURE;
+
+    seg->base = base;
+    seg->size = arena->size;
+    seg->seg_next = seg->seg_prev = NULL;
+    arena->segs = seg;
+    freelist_insert(arena, seg);
+    arena->stats.free = arena->size;
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Allocates |size| bytes, rounded up to the quantum.
+ *
+ * Instant fit: takes the first segment on the lowest freelist whose segments
+ * are all large enough, so the cost does not depend on the number of 
+ * segments.
+ * @returns The base of the allocation, or 0 on failure.
+ */
+uint64_t VMEM_alloc(VMEM_arena *arena, uint64_t size) {
+    VMEM_seg *seg, *rest;
+    uint64_t mask;
+    int index, ints_enabled = 0;
+
+    if (!size)
+        return 0;
+
+    if (size % arena->quantum)
+        size += arena->quantum - size % arena->quantum;
+
+    /* Lists at or above this index only hold segments of at least |size|. */
+    index = highbit(size);
+    if (size & (size - 1))
+        index++;
+    if (index >= VMEM_FREELISTS)
+        return 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    mask = arena->freemap >> index;
+    if (!mask) {
+        arena->stats.failures++;
+
+        if (ints_enabled)
+            STI;
+
+        return 0;
+    }
+
+    seg = arena->freelists[index + __builtin_ctzll(mask)];
+    freelist_remove(arena, seg);
+
+    /* Return the tail of the segment to the freelists. */
+    if (seg->size > size && (rest = seg_get())) {
+        rest->base = seg->base + size;
+        rest->size = seg->size - size;
+        rest->seg_prev = seg;
+        rest->seg_next = seg->seg_next;
+        if (seg->seg_next)
+            seg->seg_next->seg_prev = rest;
+        seg->seg_next = rest;
+        seg->size = size;
+        freelist_insert(arena, rest);
+    }
+
+    seg->free = 0;
+    list_push(&arena->hash[hash_index(seg->base)], seg);
+
+    arena->stats.in_use += seg->size;
+    arena->stats.free -= seg->size;
+    arena->stats.allocs++;
+
+    if (ints_enabled)
+        STI;
+
+    return seg->base;
+}
+
+/** @brief Frees the allocation starting at |addr|.
+ *
+ * Merges the freed segment with free neighbours on both sides.
+ * @returns The size of the freed allocation, or 0 if |addr| was not 
+ * allocated from |arena|.
+ */
+uint64_t VMEM_free(VMEM_arena *arena, uint64_t addr) {
+    VMEM_seg *seg, *neighbour, **chain;
+    uint64_t size;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    chain = &arena->hash[hash_index(addr)];
+    for (seg = *chain; seg && seg->base != addr; seg = seg->list_next)
+        ;
+
+    if (!seg) {
+        if (ints_enabled)
+            STI;
+
+        printk("VMEM_free: %p not allocated from %s\n", (void *) addr, 
+         arena->name);
+        return 0;
+    }
+
+    list_remove(chain, seg);
+    size = seg->size;
+    arena->stats.in_use -= size;
+    arena->stats.free += size;
+    arena->stats.frees++;
+
+    /* Coalesce with the following segment. */
+    neighbour = seg->seg_next;
+    if (neighbour && neighbour->free) {
+        freelist_remove(arena, neighbour);
+        seg->size += neighbour->size;
+        seg_unlink(arena, neighbour);
+    }
+
+    /* Coalesce with the preceding segment. */
+    neighbour = seg->seg_prev;
+    if (neighbour && neighbour->free) {
+        freelist_remove(arena, neighbour);
+        neighbour->size += seg->size;
+        seg_unlink(arena, seg);
+        seg = neighbour;
+    }
+
+    freelist_insert(arena, seg);
+
+    if (ints_enabled)
+        STI;
+
+    return size;
+}
+
+/** @brief Resizes the allocation at |addr| to |size| bytes without moving it.
+ *
+ * Growing takes the start of the free segment that follows, shrinking returns
+ * the tail to the freelists.
+ * @returns EXIT_SUCCESS, or EXIT_FAILURE if |addr| is not allocated or the
+ * segment after it is not free or too small.
+ */
+int VMEM_resize(VMEM_arena *arena, uint64_t addr, uint64_t size) {
+    VMEM_seg *seg, *next, *rest = NULL;
+    uint64_t delta;
+    int ret = EXIT_FAILURE, ints_enabled = 0;
+
+    if (!size)
+        return EXIT_FAILURE;
+
+    if (size % arena->quantum)
+        size += arena->quantum - size % arena->quantum;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    for (seg = arena->hash[hash_index(addr)]; seg && seg->base != addr; 
+     seg = seg->list_next)
+        ;
+    next = seg ? seg->seg_next : NULL;
+
+    if (!seg || size == seg->size)
+        ret = seg ? EXIT_SUCCESS : EXIT_FAILURE;
+    else if (size > seg->size) {
+        delta = size - seg->size;
+        if (next && next->free && next->size >= delta) {
+            freelist_remove(arena, next);
+            if (next->size == delta)
+                seg_unlink(arena, next);
+            else {
+                next->base += delta;
+                next->size -= delta;
+                freelist_insert(arena, next);
+            }
+
+            seg->size = size;
+            arena->stats.in_use += delta;
+            arena->stats.free -= delta;
+            ret = EXIT_SUCCESS;
+        }
+    }
+    else {
+        delta = seg->size - size;
+        if (next && next->free) { /* Hand the tail to the free neighbour. */
+            freelist_remove(arena, next);
+            next->base -= delta;
+            next->size += delta;
+            rest = next;
+        }
+        else if ((rest = seg_get())) {
+            rest->base = seg->base + size;
+            rest->size = delta;
+            rest->seg_prev = seg;
+            rest->seg_next = next;
+            if (next)
+                next->seg_prev = rest;
+            seg->seg_next = rest;
+        }
+
+        if (rest) {
+            freelist_insert(arena, rest);
+            seg->size = size;
+            arena->stats.in_use -= delta;
+            arena->stats.free += delta;
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    if (ints_enabled)
+        STI;
+
+    return ret;
+}
+
+/** @brief Returns nonzero if |addr| lies inside |arena|. */
+int VMEM_contains(VMEM_arena *arena, uint64_t addr) {
+
+    return addr >= arena->base && addr - arena->base < arena->size;
+}
+
+/** @brief Returns the size of the segment allocated at |addr|, or 0. */
+uint64_t VMEM_size(VMEM_arena *arena, uint64_t addr) {
+    VMEM_seg *seg;
+    uint64_t size = 0;
+    int ints_enabled = 0;
+
+    if (are_interrupts_enabled()) {
+        ints_enabled = 1;
+        CLI;
+    }
+
+    for (seg = arena->hash[hash_index(addr)]; seg && seg->base != addr; 
+     seg = seg->list_next)
+        ;
+    if (seg)
+        size = seg->size;
+
+    if (ints_enabled)
+        STI;
+
+    return size;
+}
+
+void VMEM_get_stats(VMEM_arena *arena, VMEM_stats *stats) {
+
+    memcpy(stats, &arena->stats, sizeof(VMEM_stats));
+}
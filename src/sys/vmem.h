@@ -0,0 +1,60 @@
+#ifndef _VMEM_H
+#define _VMEM_H
+
+#include "../lib/stdint.h"
+
+#define VMEM_FREELISTS 64
+#define VMEM_HASH_SIZE 64
+
+/** @brief Boundary tag describing one span of an arena.
+ *
+ * Every segment is on its arena's address ordered list. Free segments are 
+ * also on the freelist for their size, allocated ones on a hash chain.
+ */
+typedef struct VMEM_seg {
+    uint64_t base;
+    uint64_t size;
+    struct VMEM_seg *seg_next;
+    struct VMEM_seg *seg_prev;
+    struct VMEM_seg *list_next; /* Freelist or hash chain. */
+    struct VMEM_seg *list_prev;
+    int free;
+} VMEM_seg;
+
+/** @brief Usage counters of an arena. */
+typedef struct {
+    uint64_t in_use; /* Bytes allocated. */
+    uint64_t free;   /* Bytes free. */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures; /* Allocations that found no large enough segment. */
+} VMEM_stats;
+
+/** @brief A range of virtual addresses handed out in multiples of |quantum|.
+ *
+ * Free segments of size [2^n, 2^(n + 1)) are kept on freelists[n], so any 
+ * segment on a list above the requested size fits and can be found with one 
+ * bit scan of |freemap|.
+ */
+typedef struct {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+    uint64_t quantum;
+    VMEM_seg *segs; /* Lowest segment. */
+    VMEM_seg *freelists[VMEM_FREELISTS];
+    uint64_t freemap; /* Bit n is set when freelists[n] is not empty. */
+    VMEM_seg *hash[VMEM_HASH_SIZE]; /* Allocated segments by base. */
+    VMEM_stats stats;
+} VMEM_arena;
+
+int VMEM_init(VMEM_arena *arena, const char *name, uint64_t base, 
+ uint64_t size, uint64_t quantum);
+uint64_t VMEM_alloc(VMEM_arena *arena, uint64_t size);
+uint64_t VMEM_free(VMEM_arena *arena, uint64_t addr);
+int VMEM_resize(VMEM_arena *arena, uint64_t addr, uint64_t size);
+int VMEM_contains(VMEM_arena *arena, uint64_t addr);
+uint64_t VMEM_size(VMEM_arena *arena, uint64_t addr);
+void VMEM_get_stats(VMEM_arena *arena, VMEM_stats *stats);
+
+#endif